@@ -0,0 +1,473 @@
+/*-
+ * Copyright (c) 2025 Nicolas Provost <dev@nicolas-provost.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Throughput and latency benchmark of the MIDI reader. Synthetic MIDI
+ * streams are written to pipes (or socket pairs) read by the reader, or
+ * injected with "midi_reader_inject". The report gives the bytes and
+ * frames per second, and the percentiles of the latency of the frames,
+ * from the write of their bytes to their coming out of the queue.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+#include <sysexits.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "midi_reader.h"
+
+/* bytes written to a source at a time */
+#define BENCH_CHUNK	4096
+
+/* max count of sources of a scenario */
+#define BENCH_SRC_MAX	4
+
+/* generator of a synthetic MIDI stream: fill 'buf' with 'len' bytes */
+typedef void (*bench_gen_t) (unsigned char *buf, int len, uint32_t seed);
+
+typedef struct bench_scenario_t {
+	const char *name;
+	int nsources;
+	bench_gen_t gen[BENCH_SRC_MAX];
+} bench_scenario_t;
+
+/* latencies of the frames, in nanoseconds */
+typedef struct bench_lat_t {
+	uint32_t *v;
+	size_t len;
+	size_t size;
+} bench_lat_t;
+
+static midi_reader_t reader;
+static size_t total_size = 16 * 1024 * 1024;
+static int use_socket;
+static midi_reader_flags_t flags;
+
+static uint64_t
+bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static uint64_t
+bench_clock (void *dummy)
+{
+	return (bench_now ());
+}
+
+static uint32_t
+bench_rand (uint32_t *seed)
+{
+	*seed = *seed * 1103515245U + 12345U;
+	return ((*seed >> 16) & 0x7fff);
+}
+
+/* Terminate a stream with active sensing bytes, which are complete frames
+ * on their own.
+ */
+static void
+bench_pad (unsigned char *buf, int from, int len)
+{
+	while (from < len)
+		buf[from++] = 0xfe;
+}
+
+/* note on / note off pairs, each with its status byte */
+static void
+bench_gen_notes (unsigned char *buf, int len, uint32_t seed)
+{
+	int i = 0;
+	unsigned char ch, note;
+
+	while (i + 6 <= len) {
+		ch = bench_rand (&seed) & 0x0f;
+		note = bench_rand (&seed) & 0x7f;
+		buf[i++] = 0x90 | ch;
+		buf[i++] = note;
+		buf[i++] = 0x40 | (bench_rand (&seed) & 0x3f);
+		buf[i++] = 0x80 | ch;
+		buf[i++] = note;
+		buf[i++] = 0;
+	}
+	bench_pad (buf, i, len);
+}
+
+/* control changes using running status, 32 per status byte */
+static void
+bench_gen_cc (unsigned char *buf, int len, uint32_t seed)
+{
+	int i = 0, n;
+
+	while (i + 65 <= len) {
+		buf[i++] = 0xb0 | (bench_rand (&seed) & 0x0f);
+		for (n = 0; n < 32; n++) {
+			buf[i++] = bench_rand (&seed) & 0x7f;
+			buf[i++] = bench_rand (&seed) & 0x7f;
+		}
+	}
+	bench_pad (buf, i, len);
+}
+
+/* system exclusive frames of 4 KiB */
+static void
+bench_gen_sysex (unsigned char *buf, int len, uint32_t seed)
+{
+	int i = 0, n;
+
+	while (i + 4096 <= len) {
+		buf[i++] = 0xf0;
+		buf[i++] = 0x7d;
+		for (n = 2; n < 4095; n++)
+			buf[i++] = bench_rand (&seed) & 0x7f;
+		buf[i++] = 0xf7;
+	}
+	bench_pad (buf, i, len);
+}
+
+/* system exclusive frames short enough to fit in a frame */
+static void
+bench_gen_short_sysex (unsigned char *buf, int len, uint32_t seed)
+{
+	int i = 0, n;
+
+	while (i + 64 <= len) {
+		buf[i++] = 0xf0;
+		buf[i++] = 0x7d;
+		for (n = 2; n < 63; n++)
+			buf[i++] = bench_rand (&seed) & 0x7f;
+		buf[i++] = 0xf7;
+	}
+	bench_pad (buf, i, len);
+}
+
+/* timing clock, with some notes interrupted by clock bytes */
+static void
+bench_gen_clock (unsigned char *buf, int len, uint32_t seed)
+{
+	int i = 0, n;
+
+	while (i + 12 <= len) {
+		for (n = 0; n < 8; n++)
+			buf[i++] = 0xf8;
+		buf[i++] = 0x90 | (bench_rand (&seed) & 0x0f);
+		buf[i++] = bench_rand (&seed) & 0x7f;
+		buf[i++] = 0xf8;
+		buf[i++] = 0x7f;
+	}
+	bench_pad (buf, i, len);
+}
+
+static const bench_scenario_t scenarios[] = {
+	{ "notes", 1, { bench_gen_notes } },
+	{ "cc", 1, { bench_gen_cc } },
+	{ "sysex", 1, { bench_gen_sysex } },
+	{ "clock", 1, { bench_gen_clock } },
+	{ "mixed", 4, { bench_gen_notes, bench_gen_cc, bench_gen_clock,
+			bench_gen_short_sysex } },
+	{ NULL, 0, { NULL } }
+};
+
+static void
+bench_lat_add (bench_lat_t *lat, uint32_t v)
+{
+	if (lat->len == lat->size) {
+		lat->size = lat->size ? lat->size * 2 : 65536;
+		lat->v = realloc (lat->v, lat->size * sizeof (uint32_t));
+		if (lat->v == NULL)
+			err (EX_OSERR, "realloc");
+	}
+	lat->v[lat->len++] = v;
+}
+
+static int
+bench_lat_cmp (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static uint32_t
+bench_lat_pct (bench_lat_t *lat, int pct)
+{
+	size_t i;
+
+	if (lat->len == 0)
+		return (0);
+	i = (lat->len - 1) * pct / 100;
+	return (lat->v[i]);
+}
+
+/* Take all the frames out of the queue, 'since' is the time of the write
+ * of the oldest bytes not yet read.
+ */
+static unsigned long
+bench_drain (bench_lat_t *lat, uint64_t since)
+{
+	unsigned long n = 0;
+	uint32_t dt;
+
+	dt = (uint32_t) (bench_now () - since);
+	while (midi_reader_peek (&reader)) {
+		bench_lat_add (lat, dt);
+		midi_reader_commit (&reader);
+		n++;
+	}
+	return (n);
+}
+
+static int
+bench_unread (int fd)
+{
+	int n = 0;
+
+	if (ioctl (fd, FIONREAD, &n) < 0)
+		err (EX_OSERR, "ioctl FIONREAD");
+	return (n);
+}
+
+/* Feed the reader thru pipes or socket pairs. Return the count of frames. */
+static unsigned long
+bench_run_fd (const bench_scenario_t *sc, unsigned char **bufs, size_t len,
+		bench_lat_t *lat)
+{
+	int fds[BENCH_SRC_MAX][2], i, n, busy;
+	unsigned long frames = 0;
+	size_t off;
+	uint64_t t;
+
+	if ( ! midi_reader_init (&reader, flags, NULL))
+		errx (EX_OSERR, "cannot create reader");
+	midi_reader_set_budget (&reader, 0);
+	midi_reader_set_clock (&reader, bench_clock, NULL);
+	for (i = 0; i < sc->nsources; i++) {
+		if (use_socket) {
+			if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0)
+				err (EX_OSERR, "socketpair");
+		}
+		else if (pipe (fds[i]) < 0)
+			err (EX_OSERR, "pipe");
+		fcntl (fds[i][0], F_SETFL, O_NONBLOCK);
+		if ( ! midi_reader_add_source (&reader, fds[i][0], 0))
+			errx (EX_SOFTWARE, "cannot add source");
+	}
+
+	for (off = 0; off < len; off += BENCH_CHUNK) {
+		n = len - off < BENCH_CHUNK ? len - off : BENCH_CHUNK;
+		t = bench_now ();
+		for (i = 0; i < sc->nsources; i++) {
+			if (write (fds[i][1], bufs[i] + off, n) != n)
+				err (EX_OSERR, "write");
+		}
+		do {
+			midi_reader_update (&reader);
+			frames += bench_drain (lat, t);
+			for (busy = i = 0; i < sc->nsources; i++)
+				busy |= bench_unread (fds[i][0]);
+		} while (busy || midi_reader_pending (&reader));
+	}
+
+	midi_reader_close (&reader);
+	for (i = 0; i < sc->nsources; i++)
+		close (fds[i][1]);
+	return (frames);
+}
+
+/* Feed the reader with "midi_reader_inject", cutting the streams before a
+ * status byte every MIDI_FRAME_MAX bytes at most. Return the count of
+ * frames, or 0 if some stream cannot be cut.
+ */
+static unsigned long
+bench_run_inject (const bench_scenario_t *sc, unsigned char **bufs,
+			size_t len, bench_lat_t *lat)
+{
+	midi_frame_t f;
+	unsigned long frames = 0;
+	size_t off[BENCH_SRC_MAX] = { 0 }, end;
+	int i, busy;
+	uint64_t t;
+
+	if ( ! midi_reader_init (&reader, flags, NULL))
+		errx (EX_OSERR, "cannot create reader");
+	midi_reader_set_clock (&reader, bench_clock, NULL);
+	do {
+		for (busy = i = 0; i < sc->nsources; i++) {
+			if (off[i] >= len)
+				continue;
+			busy = 1;
+			end = off[i] + MIDI_FRAME_MAX;
+			if (end >= len)
+				end = len;
+			else {
+				while (end > off[i] && (bufs[i][end] < 0x80 ||
+						bufs[i][end] >= 0xf7))
+					end--;
+				if (end == off[i]) {
+					midi_reader_close (&reader);
+					return (0);
+				}
+			}
+			f.len = end - off[i];
+			memcpy (f.data, bufs[i] + off[i], f.len);
+			t = bench_now ();
+			if (midi_reader_inject (&reader, &f) != f.len)
+				errx (EX_SOFTWARE, "inject failed");
+			frames += bench_drain (lat, t);
+			off[i] = end;
+		}
+	} while (busy);
+	midi_reader_close (&reader);
+	return (frames);
+}
+
+static void
+bench_report (const char *name, const char *mode, size_t bytes,
+		unsigned long frames, uint64_t ns, bench_lat_t *lat)
+{
+	double s = ns / 1e9;
+	midi_reader_stats_t st;
+
+	midi_reader_get_stats (&reader, -1, &st);
+	qsort (lat->v, lat->len, sizeof (uint32_t), bench_lat_cmp);
+	printf ("%-6s %-6s %8.2f %9.0f %8u %8u %8u %8u %6lu\n",
+		name, mode, bytes / s / 1e6, frames / s / 1e3,
+		bench_lat_pct (lat, 50), bench_lat_pct (lat, 90),
+		bench_lat_pct (lat, 99), bench_lat_pct (lat, 100),
+		st.errors + st.missed);
+}
+
+static void
+bench_scenario (const bench_scenario_t *sc)
+{
+	unsigned char *bufs[BENCH_SRC_MAX];
+	bench_lat_t lat;
+	size_t len = total_size / sc->nsources;
+	unsigned long frames;
+	uint64_t t;
+	int i;
+
+	for (i = 0; i < sc->nsources; i++) {
+		if ((bufs[i] = malloc (len)) == NULL)
+			err (EX_OSERR, "malloc");
+		sc->gen[i] (bufs[i], len, i + 1);
+	}
+
+	memset (&lat, 0, sizeof (lat));
+	t = bench_now ();
+	frames = bench_run_fd (sc, bufs, len, &lat);
+	bench_report (sc->name, use_socket ? "socket" : "pipe",
+			len * sc->nsources, frames, bench_now () - t, &lat);
+	midi_reader_destroy (&reader);
+
+	lat.len = 0;
+	t = bench_now ();
+	frames = bench_run_inject (sc, bufs, len, &lat);
+	if (frames > 0) {
+		bench_report (sc->name, "inject", len * sc->nsources, frames,
+				bench_now () - t, &lat);
+	}
+	else
+		printf ("%-6s %-6s (frames too long to be injected)\n",
+			sc->name, "inject");
+	midi_reader_destroy (&reader);
+
+	free (lat.v);
+	for (i = 0; i < sc->nsources; i++)
+		free (bufs[i]);
+}
+
+static void
+usage (const char *msg)
+{
+	dprintf (2,
+	"midi_bench - MIDI reader benchmark\n"
+	"usage: midi_bench [-s] [-x] [-u] [-n <MiB>] [scenario ...]\n"
+	"    -n <MiB> bytes of MIDI data per scenario (default 16)\n"
+	"    -s use socket pairs instead of pipes\n"
+	"    -x expand running status MIDI frames\n"
+	"    -u store the frames as UMP words\n"
+	"    -h (show help)\n"
+	"scenarios: notes cc sysex clock mixed (default all)\n");
+	if (msg)
+		dprintf (2, "%s\n", msg);
+	exit (msg ? 1 : 0);
+}
+
+int
+main (int argc, char **argv)
+{
+	const bench_scenario_t *sc;
+	int c, i, n;
+
+	while ((c = getopt (argc, argv, "n:sxuh")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atoi (optarg);
+			if (n <= 0 || n > 1024)
+				usage ("bad size");
+			total_size = (size_t) n * 1024 * 1024;
+			break;
+		case 's':
+			use_socket = 1;
+			break;
+		case 'x':
+			flags |= MIDIR_EXPAND;
+			break;
+		case 'u':
+			flags |= MIDIR_UMP;
+			break;
+		case 'h':
+			usage (NULL);
+			break;
+		default:
+			usage ("bad option");
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	printf ("%-6s %-6s %8s %9s %8s %8s %8s %8s %6s\n", "test", "mode",
+		"MB/s", "kframes/s", "p50(ns)", "p90(ns)", "p99(ns)",
+		"max(ns)", "lost");
+	for (sc = scenarios; sc->name; sc++) {
+		for (i = 0; i < argc; i++) {
+			if (strcmp (argv[i], sc->name) == 0)
+				break;
+		}
+		if (argc == 0 || i < argc)
+			bench_scenario (sc);
+	}
+	return (0);
+}
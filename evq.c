@@ -0,0 +1,452 @@
+/*-
+ * Copyright (c) 2025 Nicolas Provost <dev@nicolas-provost.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include "evq.h"
+
+#ifdef EVQ_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#elif defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+static bool
+evq_pipe (evq_t *q)
+{
+	if (pipe (q->wakeup) != 0)
+		return (false);
+	for (int i = 0; i < 2; i++) {
+		fcntl (q->wakeup[i], F_SETFL, O_NONBLOCK);
+		fcntl (q->wakeup[i], F_SETFD, FD_CLOEXEC);
+	}
+	return (true);
+}
+
+static void
+evq_drain (evq_t *q)
+{
+	char buf[64];
+
+	while (read (q->wakeup[0], buf, sizeof (buf)) > 0)
+		;
+}
+
+static int
+evq_find (evq_t *q, int fd)
+{
+	for (int i = 0; i < q->nfds; i++) {
+		if (q->fds[i] == fd)
+			return (i);
+	}
+	return (-1);
+}
+
+bool
+evq_has (evq_t *q, int fd)
+{
+	return (q && evq_find (q, fd) > -1);
+}
+
+void
+evq_wakeup (evq_t *q)
+{
+	char c = 0;
+	int e = errno;
+
+	if (q && q->wakeup[1] > -1)
+		(void) write (q->wakeup[1], &c, 1);
+	errno = e;
+}
+
+#ifdef EVQ_KQUEUE
+
+bool
+evq_init (evq_t *q)
+{
+	struct kevent ke;
+
+	if (q == NULL)
+		return (false);
+	memset (q, 0, sizeof (evq_t));
+	q->wakeup[0] = q->wakeup[1] = -1;
+	q->kq = kqueue ();
+	if (q->kq < 0)
+		return (false);
+	if ( ! evq_pipe (q)) {
+		close (q->kq);
+		return (false);
+	}
+	EV_SET (&ke, q->wakeup[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (kevent (q->kq, &ke, 1, NULL, 0, NULL) < 0) {
+		evq_close (q);
+		return (false);
+	}
+	return (true);
+}
+
+void
+evq_close (evq_t *q)
+{
+	if (q) {
+		if (q->kq > -1)
+			close (q->kq);
+		if (q->wakeup[0] > -1)
+			close (q->wakeup[0]);
+		if (q->wakeup[1] > -1)
+			close (q->wakeup[1]);
+		for (int i = 0; i < q->nwatch; i++)
+			close (q->watch[i]);
+		q->kq = q->wakeup[0] = q->wakeup[1] = -1;
+		q->nfds = q->nwatch = 0;
+	}
+}
+
+bool
+evq_add (evq_t *q, int fd)
+{
+	struct kevent ke;
+
+	if (q == NULL || fd < 0)
+		return (false);
+	else if (evq_find (q, fd) > -1)
+		return (true);
+	else if (q->nfds >= EVQ_MAX)
+		return (false);
+	EV_SET (&ke, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (kevent (q->kq, &ke, 1, NULL, 0, NULL) < 0)
+		return (false);
+	q->fds[q->nfds++] = fd;
+	return (true);
+}
+
+bool
+evq_remove (evq_t *q, int fd)
+{
+	struct kevent ke;
+	int i;
+
+	if (q == NULL || (i = evq_find (q, fd)) < 0)
+		return (false);
+	/* may fail if fd was already closed */
+	EV_SET (&ke, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	(void) kevent (q->kq, &ke, 1, NULL, 0, NULL);
+	q->fds[i] = q->fds[--q->nfds];
+	return (true);
+}
+
+bool
+evq_watch (evq_t *q, const char *dir)
+{
+	struct kevent ke;
+	int fd;
+
+	if (q == NULL || dir == NULL || q->nwatch >= EVQ_WATCH_MAX)
+		return (false);
+	fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return (false);
+	/* a directory is written when an entry is added or removed */
+	EV_SET (&ke, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+			NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB, 0, NULL);
+	if (kevent (q->kq, &ke, 1, NULL, 0, NULL) < 0) {
+		close (fd);
+		return (false);
+	}
+	q->watch[q->nwatch++] = fd;
+	return (true);
+}
+
+bool
+evq_set_timer (evq_t *q, int ms)
+{
+	struct kevent ke;
+
+	if (q == NULL || ms < 0)
+		return (false);
+	if (ms > 0)
+		EV_SET (&ke, 1, EVFILT_TIMER, EV_ADD, 0, ms, NULL);
+	else if (q->timer > 0)
+		EV_SET (&ke, 1, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+	else
+		return (true);
+	if (kevent (q->kq, &ke, 1, NULL, 0, NULL) < 0)
+		return (false);
+	q->timer = ms;
+	return (true);
+}
+
+int
+evq_wait (evq_t *q, evq_event_t *ev, int max, int timeout)
+{
+	struct kevent kev[EVQ_MAX + 2];
+	struct timespec ts, *tsp = NULL;
+	int i, n, r = 0;
+
+	if (q == NULL || ev == NULL || max <= 0)
+		return (-1);
+	if (max > EVQ_MAX + 2)
+		max = EVQ_MAX + 2;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		tsp = &ts;
+	}
+	n = kevent (q->kq, NULL, 0, kev, max, tsp);
+	if (n < 0)
+		return (errno == EINTR ? 0 : -1);
+	for (i = 0; i < n; i++) {
+		if (kev[i].filter == EVFILT_TIMER) {
+			ev[r].fd = -1;
+			ev[r].type = EVQ_TIMER;
+		}
+		else if (kev[i].filter == EVFILT_VNODE) {
+			ev[r].fd = (int) kev[i].ident;
+			ev[r].type = EVQ_CHANGE;
+		}
+		else if ((int) kev[i].ident == q->wakeup[0]) {
+			evq_drain (q);
+			ev[r].fd = -1;
+			ev[r].type = EVQ_WAKEUP;
+		}
+		else {
+			ev[r].fd = (int) kev[i].ident;
+			if (kev[i].flags & (EV_EOF | EV_ERROR)) {
+				ev[r].type = EVQ_ERROR;
+				if (kev[i].data > 0)
+					ev[r].type |= EVQ_READ;
+			}
+			else
+				ev[r].type = EVQ_READ;
+		}
+		r++;
+	}
+	return (r);
+}
+
+#else /* poll */
+
+static void
+evq_deadline (evq_t *q)
+{
+	clock_gettime (CLOCK_MONOTONIC, &q->deadline);
+	q->deadline.tv_sec += q->timer / 1000;
+	q->deadline.tv_nsec += (q->timer % 1000) * 1000000L;
+	if (q->deadline.tv_nsec >= 1000000000L) {
+		q->deadline.tv_sec++;
+		q->deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+/* Milliseconds until timer expiration, 0 if expired. */
+static int
+evq_remaining (evq_t *q)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	ms = (q->deadline.tv_sec - now.tv_sec) * 1000 +
+		(q->deadline.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+	return (ms > 0 ? (int) ms : 0);
+}
+
+bool
+evq_init (evq_t *q)
+{
+	if (q == NULL)
+		return (false);
+	memset (q, 0, sizeof (evq_t));
+	q->wakeup[0] = q->wakeup[1] = -1;
+	q->inotify = -1;
+	if ( ! evq_pipe (q))
+		return (false);
+	q->dirty = true;
+	return (true);
+}
+
+void
+evq_close (evq_t *q)
+{
+	if (q) {
+		if (q->wakeup[0] > -1)
+			close (q->wakeup[0]);
+		if (q->wakeup[1] > -1)
+			close (q->wakeup[1]);
+		if (q->inotify > -1)
+			close (q->inotify);
+		q->wakeup[0] = q->wakeup[1] = q->inotify = -1;
+		q->nfds = 0;
+		q->dirty = true;
+	}
+}
+
+bool
+evq_add (evq_t *q, int fd)
+{
+	if (q == NULL || fd < 0)
+		return (false);
+	else if (evq_find (q, fd) > -1)
+		return (true);
+	else if (q->nfds >= EVQ_MAX)
+		return (false);
+	q->fds[q->nfds++] = fd;
+	q->dirty = true;
+	return (true);
+}
+
+bool
+evq_remove (evq_t *q, int fd)
+{
+	int i;
+
+	if (q == NULL || (i = evq_find (q, fd)) < 0)
+		return (false);
+	q->fds[i] = q->fds[--q->nfds];
+	q->dirty = true;
+	return (true);
+}
+
+#ifdef __linux__
+
+bool
+evq_watch (evq_t *q, const char *dir)
+{
+	if (q == NULL || dir == NULL)
+		return (false);
+	if (q->inotify < 0) {
+		q->inotify = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+		if (q->inotify < 0)
+			return (false);
+		if ( ! evq_add (q, q->inotify)) {
+			close (q->inotify);
+			q->inotify = -1;
+			return (false);
+		}
+	}
+	/* attributes change when udev sets the permissions of a new node */
+	return (inotify_add_watch (q->inotify, dir, IN_CREATE | IN_DELETE |
+				IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM) > -1);
+}
+
+/* Read the pending inotify events, only their occurrence matters. */
+static void
+evq_drain_inotify (evq_t *q)
+{
+	char buf[4096];
+
+	while (read (q->inotify, buf, sizeof (buf)) > 0)
+		;
+}
+
+#else
+
+bool
+evq_watch (evq_t *q, const char *dir)
+{
+	return (false);
+}
+
+#endif /* __linux__ */
+
+bool
+evq_set_timer (evq_t *q, int ms)
+{
+	if (q == NULL || ms < 0)
+		return (false);
+	q->timer = ms;
+	if (ms > 0)
+		evq_deadline (q);
+	return (true);
+}
+
+int
+evq_wait (evq_t *q, evq_event_t *ev, int max, int timeout)
+{
+	int i, n, r = 0;
+
+	if (q == NULL || ev == NULL || max <= 0)
+		return (-1);
+	if (q->dirty) {
+		q->pfd[0].fd = q->wakeup[0];
+		q->pfd[0].events = POLLIN;
+		for (i = 0; i < q->nfds; i++) {
+			q->pfd[i + 1].fd = q->fds[i];
+			q->pfd[i + 1].events = POLLIN | POLLPRI;
+		}
+		q->dirty = false;
+	}
+	if (q->timer > 0) {
+		int ms = evq_remaining (q);
+
+		if (timeout < 0 || ms < timeout)
+			timeout = ms;
+	}
+	n = poll (q->pfd, q->nfds + 1, timeout);
+	if (n < 0)
+		return (errno == EINTR ? 0 : -1);
+	for (i = 0; n > 0 && i <= q->nfds && r < max; i++) {
+		short re = q->pfd[i].revents;
+
+		if (re == 0)
+			continue;
+		n--;
+		if (i == 0) {
+			evq_drain (q);
+			ev[r].fd = -1;
+			ev[r].type = EVQ_WAKEUP;
+		}
+#ifdef __linux__
+		else if (q->pfd[i].fd == q->inotify) {
+			evq_drain_inotify (q);
+			ev[r].fd = q->inotify;
+			ev[r].type = EVQ_CHANGE;
+		}
+#endif
+		else {
+			ev[r].fd = q->pfd[i].fd;
+			ev[r].type = 0;
+			if (re & (POLLIN | POLLPRI))
+				ev[r].type |= EVQ_READ;
+			if (re & (POLLERR | POLLHUP | POLLNVAL))
+				ev[r].type |= EVQ_ERROR;
+		}
+		r++;
+	}
+	if (q->timer > 0 && r < max && evq_remaining (q) == 0) {
+		evq_deadline (q);
+		ev[r].fd = -1;
+		ev[r].type = EVQ_TIMER;
+		r++;
+	}
+	return (r);
+}
+
+#endif /* EVQ_KQUEUE */
@@ -0,0 +1,137 @@
+/*-
+ * Copyright (c) 2025 Nicolas Provost <dev@nicolas-provost.fr>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef EVQ_H
+#define EVQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__FreeBSD__) || defined(__DragonFly__) || defined(__NetBSD__) || \
+	defined(__OpenBSD__) || defined(__APPLE__)
+#define EVQ_KQUEUE
+#else
+#include <poll.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* max count of file descriptors watched by an event queue */
+#define EVQ_MAX	128
+
+/* max count of directories watched by an event queue */
+#define EVQ_WATCH_MAX	16
+
+/* type of event */
+typedef enum evq_type_t {
+	EVQ_READ = 1, /* file descriptor is readable */
+	EVQ_ERROR = 2, /* file descriptor is closed or in error */
+	EVQ_TIMER = 4, /* timer expired */
+	EVQ_WAKEUP = 8, /* "evq_wakeup" was called */
+	EVQ_CHANGE = 16, /* entries of a watched directory changed */
+} evq_type_t;
+
+/* an event returned by "evq_wait" */
+typedef struct evq_event_t {
+	int fd; /* file descriptor or -1 */
+	evq_type_t type;
+} evq_event_t;
+
+/* Event queue, waiting on a set of file descriptors, a periodic timer and
+ * a wakeup pipe. It uses kqueue(2) on BSDs and poll(2) elsewhere. Except
+ * "evq_wakeup", functions should only be called by the thread owning the
+ * queue.
+ */
+typedef struct evq_t {
+	int fds[EVQ_MAX]; /* watched file descriptors */
+	int nfds; /* count of watched file descriptors */
+	int wakeup[2]; /* wakeup pipe */
+	int timer; /* timer period in ms, 0 if none */
+#ifdef EVQ_KQUEUE
+	int kq; /* kqueue descriptor */
+	int watch[EVQ_WATCH_MAX]; /* descriptors of watched directories */
+	int nwatch; /* count of watched directories */
+#else
+	int inotify; /* inotify descriptor or -1 */
+	struct pollfd pfd[EVQ_MAX + 1]; /* poll array, wakeup pipe first */
+	bool dirty; /* poll array must be rebuilt */
+	struct timespec deadline; /* next timer expiration */
+#endif
+} evq_t;
+
+/* Initialize an event queue. Returns false on failure. */
+bool
+evq_init (evq_t *q);
+
+/* Close an event queue. Watched file descriptors are not closed. */
+void
+evq_close (evq_t *q);
+
+/* Watch a file descriptor for reading. Returns false on failure. */
+bool
+evq_add (evq_t *q, int fd);
+
+/* Stop watching a file descriptor. Returns false if it was not watched. */
+bool
+evq_remove (evq_t *q, int fd);
+
+/* Return true if the file descriptor is watched. */
+bool
+evq_has (evq_t *q, int fd);
+
+/* Watch a directory for entries being created, removed or changed. An
+ * EVQ_CHANGE event is returned by "evq_wait" when that occurs, without
+ * telling which entry. It uses EVFILT_VNODE with kqueue and inotify(7) on
+ * Linux. Returns false on failure or if not supported.
+ */
+bool
+evq_watch (evq_t *q, const char *dir);
+
+/* Set a periodic timer of 'ms' milliseconds, or disable it if 0. */
+bool
+evq_set_timer (evq_t *q, int ms);
+
+/* Wake up the thread waiting in "evq_wait". May be called from any thread,
+ * and is safe to call from a signal handler.
+ */
+void
+evq_wakeup (evq_t *q);
+
+/* Wait until at least one event occurs or 'timeout' ms elapsed (-1: no
+ * timeout). Up to 'max' events are stored in 'ev'. Returns the count of
+ * events, 0 on timeout or -1 on error.
+ */
+int
+evq_wait (evq_t *q, evq_event_t *ev, int max, int timeout);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif /* EVQ_H */
@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
@@ -38,31 +39,194 @@
 #include <errno.h>
 #include <sysexits.h>
 #include <sys/errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sched.h>
 #include <pwd.h>
 
+#if defined(__FreeBSD__)
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+#define	JACK_MIDI_AFFINITY
+typedef cpuset_t jack_midi_cpuset_t;
+#elif defined(__linux__) && defined(CPU_SETSIZE)	/* _GNU_SOURCE */
+#define	JACK_MIDI_AFFINITY
+typedef cpu_set_t jack_midi_cpuset_t;
+#endif
+#ifdef JACK_MIDI_AFFINITY
+#define	JACK_MIDI_CPU_LAST	(CPU_SETSIZE - 1)
+#else
+#define	JACK_MIDI_CPU_LAST	1023
+#endif
+
 #include <jack/jack.h>
 #include <jack/midiport.h>
 #include <jack/ringbuffer.h>
 
 #include "midi_reader.h"
+#include "evq.h"
 
 #define	JACK_PORT_NAME		"jack_midi"
-#define	JACK_OUT_MAX	17		/* units */
+#define	JACK_OUT_MAX	65		/* units */
+#define	JACK_MIDI_HOTPLUG_MS	250		/* main loop tick, if needed */
+#define	JACK_MIDI_BACKOFF_MIN	10		/* ms, first re-open delay */
+#define	JACK_MIDI_BACKOFF_MAX	2000		/* ms, max re-open delay */
+#define	JACK_MIDI_DEV_MAX	(JACK_OUT_MAX - 1)	/* devices */
+#define	JACK_MIDI_OUT_SIZE	16384		/* bytes, Jack to writer */
+#define	JACK_MIDI_OUT_BUF	1024		/* bytes per write() */
+#define	JACK_MIDI_THRU_SIZE	4096		/* bytes, reader to writer */
+#define	JACK_MIDI_THRU_MAX	64		/* -T options */
+#define	JACK_MIDI_XFORM_MAX	64		/* -X options */
+#define	JACK_MIDI_RETRY_MS	1		/* partial write retry */
+#define	JACK_MIDI_FILTER_MAX	256		/* -f and -F options */
+#define	JACK_MIDI_PROBE_MS	20		/* loopback probe period */
+#define	JACK_MIDI_PROBE_WAIT	1000000		/* us, probe is lost */
+#define	JACK_MIDI_PROBE_LEN	9		/* bytes of a probe */
+#define	JACK_MIDI_PROBE_HIST	20		/* histogram buckets */
+#define	JACK_MIDI_HIST_MAX	16		/* metrics, log2 of us */
+#define	JACK_MIDI_DUMP_WAKE	(MIDI_READER_DUMP_SIZE / 4) /* bytes */
+#define	JACK_MIDI_SHARD_MAX	8		/* reader threads */
+#define	JACK_MIDI_BATCH		64		/* frames peeked at once */
+#define	JACK_MIDI_CPU_MAX	64		/* -c option */
+#define	JACK_MIDI_QUEUE_MIN	65536		/* bytes, holds a long SysEx */
+#define	JACK_MIDI_QUEUE_RATE	75000		/* queue bytes/s of a device
+						 * at 31250 baud, 1-byte frames */
+#define	JACK_MIDI_QUEUE_PERIODS	4		/* periods kept in a queue */
+#define	JACK_MIDI_PERIOD_MAX	8192		/* frames, without -b */
+
+/* a MIDI device, for capture and/or playback */
+typedef struct jack_midi_dev_t {
+	char *read_name; /* capture device path or NULL */
+	char *write_name; /* playback device path or NULL */
+	int read_fd;
+	int write_fd;
+	int read_lost; /* reader thread found read_fd closed */
+	int shard; /* index of the reader thread of the capture side */
+	int write_lost; /* writer thread could not write to write_fd */
+	jack_time_t retry_at; /* next open attempt of a missing side (us) */
+	int retry_ms; /* delay after the next failed attempt */
+	jack_port_t *input_port; /* playback port (.RX) */
+	jack_ringbuffer_t *out_rb; /* events from Jack to the writer */
+	unsigned long out_lost; /* events lost because out_rb was full */
+	uint64_t thru; /* devices the captured frames are routed to (-T) */
+	jack_ringbuffer_t *thru_rb[JACK_MIDI_SHARD_MAX]; /* routed frames from
+						* each reader thread or NULL */
+	unsigned long thru_lost; /* routed frames lost, thru_rb full */
+	unsigned char out_buf[JACK_MIDI_OUT_BUF]; /* bytes being written */
+	int out_len; /* count of bytes in out_buf */
+	int out_off; /* count of bytes of out_buf already written */
+	uint32_t out_rest; /* bytes of a long event still in out_rb */
+	unsigned char out_running; /* running status sent to device or 0 */
+	uint32_t out_high; /* max count of bytes used in out_rb */
+	midi_reader_transform_t *transform; /* -X, of the capture side */
+} jack_midi_dev_t;
+
+/* A reader thread with its own reader, parsing a part of the capture
+ * devices. Its queue is consumed by the Jack thread.
+ */
+typedef struct jack_midi_shard_t {
+	midi_reader_t reader;
+	pthread_mutex_t mtx; /* protects reader, read_lost, consumed */
+	pthread_t thread;
+	evq_t evq; /* MIDI-in devices of the shard */
+	int gen; /* incremented when reader sources change */
+	int consumed; /* a Jack client consumes (or will) the queue */
+	int thru_pending; /* routed frames queued for the writer */
+} jack_midi_shard_t;
+
+/* Frames of a reader queue being sent by the Jack thread. */
+typedef struct jack_midi_batch_t {
+	const midi_qframe_t *qf[JACK_MIDI_BATCH]; /* frames of the queue */
+	int n; /* count of frames in qf */
+	int pos; /* count of frames of qf already sent */
+} jack_midi_batch_t;
+
+/* Last event of a period on a channel of an output unit, which a newer
+ * value of the same message may replace. Entries of previous periods are
+ * unused.
+ */
+typedef struct jack_midi_coal_t {
+	uint32_t key; /* status byte and controller, 0 if not coalesced */
+	uint32_t cycle; /* period of the entry */
+	uint8_t *ev; /* event reserved in the Jack buffer or NULL */
+} jack_midi_coal_t;
+
+/* Metrics of the Jack thread, which is their only writer. Bucket 'b' of a
+ * histogram counts the values 'v' (us) with 2^(b-1) <= v < 2^b, bucket 0
+ * the zero values and the last one all the values above.
+ */
+typedef struct jack_midi_metrics_t {
+	uint64_t cycles; /* count of process callbacks */
+	uint64_t cycle_time; /* cumulated time of the callbacks (us) */
+	uint64_t cycle_max; /* longest callback (us) */
+	uint64_t cycle_hist[JACK_MIDI_HIST_MAX]; /* callback time */
+	uint64_t dwell_hist[JACK_MIDI_HIST_MAX]; /* frame read to Jack event */
+	uint64_t deferred; /* frames kept for next period, Jack buffer full */
+	uint64_t coalesced; /* frames merged into an event of the period */
+	uint64_t tx_lost[JACK_OUT_MAX]; /* events not reserved, by unit */
+} jack_midi_metrics_t;
+
+/* update or get a metric, without tearing */
+#define	JACK_MIDI_ADD(var, n) __atomic_store_n (&(var), \
+		__atomic_load_n (&(var), __ATOMIC_RELAXED) + (n), \
+		__ATOMIC_RELAXED)
+#define	JACK_MIDI_SET(var, v) \
+		__atomic_store_n (&(var), (v), __ATOMIC_RELAXED)
+#define	JACK_MIDI_GET(var) __atomic_load_n (&(var), __ATOMIC_RELAXED)
 
 static jack_port_t *output_port[JACK_OUT_MAX];
-static jack_port_t *input_port;
 static jack_client_t *jack_client;
-static midi_reader_t reader;
-static int read_fd = -1;
-static int write_fd = -1;
+static jack_midi_shard_t shards[JACK_MIDI_SHARD_MAX];
+static int nshards = 1; /* -j */
+static jack_midi_batch_t batches[JACK_MIDI_SHARD_MAX]; /* Jack thread */
+static int coalesce; /* -o */
+static int thru_only; /* -t, routed frames are not sent to Jack */
+static jack_midi_coal_t coal[JACK_OUT_MAX][16]; /* Jack thread */
+static uint32_t coal_cycle; /* current period of coal */
+static int rt_prio; /* -p, SCHED_FIFO priority of I/O threads or 0 */
+static int cpus[JACK_MIDI_CPU_MAX]; /* -c, CPUs of the I/O threads */
+static int ncpus;
+static jack_midi_dev_t devs[JACK_MIDI_DEV_MAX];
+static int ndevs;
 static int kill_on_close;
+static int running_status; /* use running status on playback */
 static int debug_mode;
-static char *read_name = NULL;
-static char *write_name = NULL;
 static char *port_name = NULL;
-static pthread_mutex_t jack_midi_mtx; /* protects read_fd, write_fd */
+static pthread_mutex_t jack_midi_mtx; /* protects read_fd, write_fd, client */
 static uid_t uid = -1;
-static jack_nframes_t jack_counter;
+static pthread_t writer_thread;
+static evq_t main_evq; /* device directories, timer and wakeups */
+static bool dev_watch; /* directories of all the devices are watched */
+static evq_t writer_evq; /* wakeups of the writer thread */
+static volatile sig_atomic_t jack_shutdown; /* Jack server went away */
+static int jack_lost; /* had a Jack client, waiting for the server */
+static jack_nframes_t buffer_size; /* -b, 0 to keep the server one */
+static jack_nframes_t jack_period; /* frames per period of the server */
+static jack_nframes_t prev_nframes; /* frames of the previous period */
+static jack_midi_metrics_t metrics;
+static char *stats_path; /* -s, stats socket path or NULL */
+static int stats_fd = -1; /* stats socket, main loop */
+static time_t start_time;
+static char *replay_path; /* -R, capture to replay or NULL */
+static double replay_speed = 1.0; /* -A, 0 for no delay */
+static midi_log_t replay_log;
+static pthread_t replay_thread;
+static int replay_done; /* replay thread is over */
+
+/* loopback test (-L): probes sent to a device and read back */
+static int probe_count; /* probes to send, 0 if no test */
+static jack_midi_dev_t *probe_dev; /* device with a loopback */
+static int probe_sent; /* count of probes sent */
+static int probe_received; /* count of probes read back */
+static jack_time_t probe_last; /* time the last probe was sent */
+static jack_time_t *probe_time; /* time each probe was sent */
+static uint32_t *probe_rtt; /* round trip of each probe (us), 0 if none */
+static int probe_done; /* main loop should print the report */
 
 #ifdef HAVE_DEBUG
 #define	DPRINTF(fmt, ...) printf("%s:%d: " fmt, __FUNCTION__, __LINE__,## __VA_ARGS__)
@@ -96,23 +260,252 @@ jack_midi_uid (const char *s)
 		uid = pw->pw_uid;
 }
 
+/* Add a device. Return false if there are too many devices. */
+static bool
+jack_midi_add_dev (const char *read_name, const char *write_name)
+{
+	jack_midi_dev_t *dev;
+
+	if (ndevs == JACK_MIDI_DEV_MAX)
+		return (false);
+	dev = &devs[ndevs++];
+	dev->read_name = read_name ? strdup (read_name) : NULL;
+	dev->write_name = write_name ? strdup (write_name) : NULL;
+	dev->read_fd = -1;
+	dev->write_fd = -1;
+	dev->retry_ms = JACK_MIDI_BACKOFF_MIN;
+	if (write_name) {
+		dev->out_rb = jack_ringbuffer_create (JACK_MIDI_OUT_SIZE);
+		if (dev->out_rb == NULL)
+			errx (EX_OSERR, "Out of memory.");
+		jack_ringbuffer_mlock (dev->out_rb);
+	}
+	return (true);
+}
+
+/* Return the name of a device without its /dev/ prefix. */
+static const char *
+jack_midi_dev_name (jack_midi_dev_t *dev)
+{
+	const char *name = dev->read_name ? dev->read_name : dev->write_name;
+
+	if (strncmp (name, "/dev/", 5) == 0)
+		return (name + 5);
+	else
+		return (name);
+}
+
+/* Copy bytes at offset 'off' of the free space of a ring buffer. */
 static void
-jack_midi_write (jack_nframes_t nframes)
+jack_midi_vec_copy (jack_ringbuffer_data_t *vec, size_t off,
+			const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t n = 0;
+
+	if (off < vec[0].len) {
+		n = len < vec[0].len - off ? len : vec[0].len - off;
+		memcpy (vec[0].buf + off, p, n);
+		off = 0;
+	}
+	else
+		off -= vec[0].len;
+	if (n < len)
+		memcpy (vec[1].buf + off, p + n, len - n);
+}
+
+/* Store a whole event in a ring buffer, after its length, or nothing if
+ * there is not enough room. The event is made available to the reader at
+ * once, so that the writer can merge the events of several ring buffers.
+ */
+static bool
+jack_midi_out_put (jack_ringbuffer_t *rb, const unsigned char *data,
+			size_t len)
+{
+	jack_ringbuffer_data_t vec[2];
+	uint32_t hdr = len;
+
+	if (jack_ringbuffer_write_space (rb) < sizeof (hdr) + len)
+		return (false);
+	jack_ringbuffer_get_write_vector (rb, vec);
+	jack_midi_vec_copy (vec, 0, &hdr, sizeof (hdr));
+	jack_midi_vec_copy (vec, sizeof (hdr), data, len);
+	jack_ringbuffer_write_advance (rb, sizeof (hdr) + len);
+	return (true);
+}
+
+/* Move the whole events of a ring buffer to the write buffer of a device,
+ * as long as they fit. Only an event of out_rb may be longer than the
+ * write buffer: it is then moved alone, its rest being left in out_rb.
+ */
+static void
+jack_midi_out_get (jack_midi_dev_t *dev, jack_ringbuffer_t *rb)
+{
+	uint32_t len, room;
+
+	while (dev->out_rest == 0 && jack_ringbuffer_peek (rb, (char*) &len,
+					sizeof (len)) == sizeof (len)) {
+		room = JACK_MIDI_OUT_BUF - dev->out_len;
+		if (len > room && dev->out_len > 0)
+			break;
+		jack_ringbuffer_read_advance (rb, sizeof (len));
+		if (len > room) {
+			dev->out_rest = len - room;
+			len = room;
+		}
+		jack_ringbuffer_read (rb, (char*) dev->out_buf + dev->out_len,
+									len);
+		dev->out_len += len;
+	}
+}
+
+/* Queue a loopback probe when it is time to. The probe is a system
+ * exclusive frame (non-commercial ID 0x7D, 'L') with a sequence number.
+ * Return the count of queued probes.
+ */
+static int
+jack_midi_probe_send (void)
+{
+	unsigned char p[JACK_MIDI_PROBE_LEN];
+	jack_time_t now;
+	uint32_t seq = probe_sent;
+	int i;
+
+	if (probe_sent == probe_count || probe_dev->write_fd < 0)
+		return (0);
+	now = jack_get_time ();
+	if (probe_sent > 0 && now - probe_last < JACK_MIDI_PROBE_MS * 1000)
+		return (0);
+	p[0] = 0xf0;
+	p[1] = 0x7d;
+	p[2] = 'L';
+	for (i = 0; i < 5; i++, seq >>= 7)
+		p[3 + i] = seq & 0x7f;
+	p[8] = 0xf7;
+	if ( ! jack_midi_out_put (probe_dev->out_rb, p, sizeof (p)))
+		return (0);
+	probe_time[probe_sent++] = now;
+	probe_last = now;
+	return (1);
+}
+
+/* Check if a frame is a probe read back. Time its round trip if so, and
+ * tell the main loop when the test is over. Return true for a probe.
+ */
+static bool
+jack_midi_probe_recv (const midi_qframe_t *qf)
+{
+	jack_time_t now = jack_get_time ();
+	jack_time_t rtt;
+	uint32_t seq = 0;
+	int i;
+
+	if (qf != NULL && qf->len == JACK_MIDI_PROBE_LEN &&
+			qf->data[1] == 0x7d && qf->data[2] == 'L' &&
+			qf->data[0] == 0xf0) {
+		for (i = 4; i >= 0; i--)
+			seq = (seq << 7) | qf->data[3 + i];
+		if (seq < (uint32_t) probe_sent && probe_rtt[seq] == 0) {
+			rtt = now - probe_time[seq];
+			probe_rtt[seq] = rtt > 0 ? rtt : 1;
+			probe_received++;
+		}
+	}
+	else
+		qf = NULL;
+
+	if ( ! __atomic_load_n (&probe_done, __ATOMIC_RELAXED) &&
+		(probe_received == probe_count || (probe_sent == probe_count &&
+			now - probe_last > JACK_MIDI_PROBE_WAIT))) {
+		__atomic_store_n (&probe_done, 1, __ATOMIC_RELEASE);
+		evq_wakeup (&main_evq);
+	}
+	return (qf != NULL);
+}
+
+static int
+jack_midi_probe_cmp (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/* Print the latency and jitter of the loopback test. */
+static void
+jack_midi_probe_report (void)
+{
+	unsigned long hist[JACK_MIDI_PROBE_HIST] = { 0 };
+	double avg = 0, dev = 0, delta = 0;
+	uint32_t *v, lo, hi, step, prev = 0;
+	int i, n = 0, b;
+
+	printf ("loopback: %d probes sent, %d received, %d lost, "
+		"Jack period %u frames\n", probe_sent, probe_received,
+		probe_sent - probe_received,
+		(unsigned) __atomic_load_n (&jack_period, __ATOMIC_RELAXED));
+	if (probe_received == 0)
+		return;
+
+	/* jitter between consecutive probes, in sending order */
+	v = malloc (probe_received * sizeof (uint32_t));
+	if (v == NULL)
+		errx (EX_OSERR, "Out of memory.");
+	for (i = 0; i < probe_sent; i++) {
+		if (probe_rtt[i] == 0)
+			continue;
+		if (n > 0)
+			delta += probe_rtt[i] > prev ? probe_rtt[i] - prev :
+							prev - probe_rtt[i];
+		prev = v[n++] = probe_rtt[i];
+		avg += probe_rtt[i];
+	}
+	avg /= n;
+	for (i = 0; i < n; i++)
+		dev += (v[i] - avg) * (v[i] - avg);
+	qsort (v, n, sizeof (uint32_t), jack_midi_probe_cmp);
+	lo = v[0];
+	hi = v[n - 1];
+	printf ("latency (us): min %u avg %.0f p99 %u max %u\n",
+		lo, avg, v[(n - 1) * 99 / 100], hi);
+	printf ("jitter (us): stddev %.0f, mean delta %.0f\n",
+		n > 1 ? sqrt (dev / (n - 1)) : 0.0,
+		n > 1 ? delta / (n - 1) : 0.0);
+
+	/* histogram of the round trips */
+	step = (hi - lo) / JACK_MIDI_PROBE_HIST + 1;
+	for (i = 0; i < n; i++)
+		hist[(v[i] - lo) / step]++;
+	for (b = 0; b < JACK_MIDI_PROBE_HIST; b++) {
+		printf ("%8u-%-8u %6lu ", lo + b * step,
+			lo + (b + 1) * step - 1, hist[b]);
+		for (i = 0; i < (int) (hist[b] * 50 / n); i++)
+			putchar ('#');
+		putchar ('\n');
+	}
+	free (v);
+}
+
+/* Queue the events received on the playback port of a device. Return the
+ * count of queued events.
+ */
+static int
+jack_midi_write_dev (jack_midi_dev_t *dev, jack_nframes_t nframes)
 {
 	int error;
 	int events;
-	int i;
+	int i, n = 0;
 	void *buf;
 	jack_midi_event_t event;
 
-	if (input_port == NULL)
-		return;
+	if (dev->input_port == NULL)
+		return (0);
 
-	buf = jack_port_get_buffer (input_port, nframes);
+	buf = jack_port_get_buffer (dev->input_port, nframes);
 	if (buf == NULL) {
 		DPRINTF ("jack_port_get_buffer() failed, "
 				"cannot receive anything.\n");
-		return;
+		return (0);
 	}
 #ifdef JACK_MIDI_NEEDS_NFRAMES
 	events = jack_midi_get_event_count (buf, nframes);
@@ -130,129 +523,1183 @@ jack_midi_write (jack_nframes_t nframes)
 			DPRINTF ("lost MIDI event.\n");
 			continue;
 		}
-		jack_midi_lock ();
-		if (write_fd > -1) {
-			if (write (write_fd, event.buffer, event.size) !=
-								event.size) {
-				DPRINTF ("write() failed.\n");
+		if (jack_midi_out_put (dev->out_rb, event.buffer, event.size))
+			n++;
+		else
+			dev->out_lost++;
+	}
+	if (n > 0) {
+		uint32_t used = jack_ringbuffer_read_space (dev->out_rb);
+
+		if (used > dev->out_high)
+			JACK_MIDI_SET (dev->out_high, used);
+	}
+	return (n);
+}
+
+/* Queue the events received on the playback ports, for the writer
+ * thread: no lock nor syscall, except for waking up the writer.
+ */
+static void
+jack_midi_write (jack_nframes_t nframes)
+{
+	int n = 0;
+
+	for (int i = 0; i < ndevs; i++)
+		n += jack_midi_write_dev (&devs[i], nframes);
+	if (probe_count > 0)
+		n += jack_midi_probe_send ();
+	if (n > 0)
+		evq_wakeup (&writer_evq);
+}
+
+/* Remove in place the status bytes of a byte stream which are the same as
+ * the running status. Real-time bytes may appear anywhere and do not change
+ * the running status; system exclusive and common messages reset it.
+ * Return the new length.
+ */
+static int
+jack_midi_running_status (jack_midi_dev_t *dev, unsigned char *buf, int len)
+{
+	int i, n;
+
+	for (i = n = 0; i < len; i++) {
+		unsigned char b = buf[i];
+
+		if (b >= 0x80 && b <= 0xef) {
+			if (b == dev->out_running)
+				continue;
+			dev->out_running = b;
+		}
+		else if (b >= 0xf0 && b <= 0xf7)
+			dev->out_running = 0;
+		buf[n++] = b;
+	}
+	return (n);
+}
+
+/* Write the queued events of a device, merging them into big writes.
+ * Return true if some bytes are still to be written. Called locked.
+ */
+static bool
+jack_midi_flush_dev (jack_midi_dev_t *dev)
+{
+	ssize_t r;
+
+	if (dev->out_rb == NULL)
+		return (false);
+	if (dev->write_fd < 0 || dev->write_lost) {
+		/* device is closed, drop everything */
+		jack_ringbuffer_read_advance (dev->out_rb,
+				jack_ringbuffer_read_space (dev->out_rb));
+		for (int i = 0; i < nshards; i++) {
+			if (dev->thru_rb[i] == NULL)
+				continue;
+			jack_ringbuffer_read_advance (dev->thru_rb[i],
+				jack_ringbuffer_read_space (dev->thru_rb[i]));
+		}
+		dev->out_len = dev->out_off = 0;
+		dev->out_rest = 0;
+		dev->out_running = 0;
+		return (false);
+	}
+	while (1) {
+		if (dev->out_off == dev->out_len) {
+			dev->out_off = dev->out_len = 0;
+			if (dev->out_rest > 0) {
+				/* rest of an event longer than out_buf */
+				dev->out_len = jack_ringbuffer_read (
+					dev->out_rb, (char*) dev->out_buf,
+					dev->out_rest < JACK_MIDI_OUT_BUF ?
+					dev->out_rest : JACK_MIDI_OUT_BUF);
+				dev->out_rest -= dev->out_len;
 			}
+			else {
+				/* routed frames first, they are waited for */
+				for (int i = 0; i < nshards; i++) {
+					if (dev->thru_rb[i] != NULL)
+						jack_midi_out_get (dev,
+							dev->thru_rb[i]);
+				}
+				jack_midi_out_get (dev, dev->out_rb);
+			}
+			if (running_status) {
+				dev->out_len = jack_midi_running_status (dev,
+						dev->out_buf, dev->out_len);
+			}
+			if (dev->out_len == 0)
+				return (false);
+		}
+		r = write (dev->write_fd, dev->out_buf + dev->out_off,
+				dev->out_len - dev->out_off);
+		if (r > 0)
+			dev->out_off += r;
+		else if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			return (true);
+		else {
+			/* the device will be closed by the main loop */
+			DPRINTF ("write() failed.\n");
+			dev->write_lost = 1;
+			dev->out_off = dev->out_len;
+			dev->out_running = 0;
+			evq_wakeup (&main_evq);
+			return (false);
+		}
+	}
+}
+
+/* Thread writing the events received from Jack to the MIDI-out devices.
+ * A partial write is resumed later, so that messages are never cut.
+ */
+static void *
+jack_midi_writer_thread (void *arg)
+{
+	evq_event_t ev[4];
+	bool pending = false;
+
+	while (1) {
+		if (evq_wait (&writer_evq, ev, 4,
+				pending ? JACK_MIDI_RETRY_MS : -1) < 0) {
+			DPRINTF ("evq_wait() failed.\n");
+			usleep (JACK_MIDI_HOTPLUG_MS * 1000);
+		}
+		pending = false;
+		jack_midi_lock ();
+		for (int i = 0; i < ndevs; i++) {
+			if (jack_midi_flush_dev (&devs[i]))
+				pending = true;
 		}
 		jack_midi_unlock ();
 	}
+
+	/* not reached */
+	return (NULL);
+}
+
+/* Clock of the MIDI reader. */
+static uint64_t
+jack_midi_clock (void *arg)
+{
+	return (jack_get_time ());
+}
+
+/* Get the offset in the current period of an event received at time 't'.
+ * Events received during the previous period, 'prev' frames long, are
+ * played in the current one with the same offset, so that the timing
+ * between them is kept. The offset is never less than 'min' since events
+ * must be sorted.
+ */
+static jack_nframes_t
+jack_midi_offset (jack_time_t t, jack_nframes_t start, jack_nframes_t prev,
+			jack_nframes_t nframes, jack_nframes_t min)
+{
+	int32_t off;
+
+	off = (int32_t) (jack_time_to_frames (jack_client, t) + prev - start);
+	if (off < (int32_t) min)
+		return (min);
+	else if (off >= (int32_t) nframes)
+		return (nframes - 1);
+	else
+		return ((jack_nframes_t) off);
+}
+
+/* Check that a frame of 'len' bytes can be stored in the 'nd' Jack
+ * buffers of 'dst'. A buffer still empty is never considered full, the
+ * frame is lost for it if it is too long.
+ */
+static bool
+jack_midi_room (void **buf, int *count, const int *dst, int nd, size_t len)
+{
+	for (int k = 0; k < nd; k++) {
+		if (count[dst[k]] > 0 &&
+				jack_midi_max_event_size (buf[dst[k]]) < len)
+			return (false);
+	}
+	return (true);
+}
+
+/* Count a value (us) in a histogram of the metrics. */
+static inline void
+jack_midi_hist (uint64_t *hist, uint64_t v)
+{
+	int b = v ? 64 - __builtin_clzll (v) : 0;
+
+	if (b >= JACK_MIDI_HIST_MAX)
+		b = JACK_MIDI_HIST_MAX - 1;
+	JACK_MIDI_ADD (hist[b], 1);
+}
+
+/* Merge the reader queues: return the oldest frame at their heads, or NULL
+ * if they are empty. 'shard' gets the index of its queue. The frames are
+ * taken by batches, and only removed from the queues by "jack_midi_done".
+ */
+static const midi_qframe_t *
+jack_midi_next (int *shard)
+{
+	const midi_qframe_t *qf, *best = NULL;
+	jack_midi_batch_t *b;
+
+	for (int i = 0; i < nshards; i++) {
+		b = &batches[i];
+		if (b->pos == b->n) {
+			midi_reader_commit_batch (&shards[i].reader, b->n);
+			b->n = midi_reader_peek_batch (&shards[i].reader, b->qf,
+							JACK_MIDI_BATCH);
+			b->pos = 0;
+		}
+		if (b->pos == b->n)
+			continue;
+		qf = b->qf[b->pos];
+		if (best == NULL || qf->time < best->time) {
+			best = qf;
+			*shard = i;
+		}
+	}
+	return (best);
 }
 
+/* Remove the frames sent from the reader queues. */
 static void
-jack_midi_read (jack_nframes_t nframes)
+jack_midi_done (void)
+{
+	for (int i = 0; i < nshards; i++) {
+		midi_reader_commit_batch (&shards[i].reader, batches[i].pos);
+		batches[i].n = batches[i].pos = 0;
+	}
+}
+
+/* Key of a frame which may be coalesced, holding a single control change,
+ * channel pressure or pitch bend message, or 0. The controllers whose
+ * meaning depends on the messages around them are never coalesced: bank
+ * select (0, 32), data entry (6, 38, 96, 97), parameter numbers (98-101)
+ * and channel mode messages (120-127).
+ */
+static uint32_t
+jack_midi_coal_key (const midi_qframe_t *qf)
+{
+	unsigned char ctl;
+
+	switch (qf->data[0] & 0xf0) {
+	case 0xb0:
+		if (qf->len != 3)
+			return (0);
+		ctl = qf->data[1];
+		if (ctl == 0 || ctl == 32 || ctl == 6 || ctl == 38 ||
+				(ctl >= 96 && ctl <= 101) || ctl >= 120)
+			return (0);
+		return ((uint32_t) qf->data[0] << 8 | ctl);
+	case 0xd0:
+		if (qf->len != 2)
+			return (0);
+		return ((uint32_t) qf->data[0] << 8);
+	case 0xe0:
+		if (qf->len != 3)
+			return (0);
+		return ((uint32_t) qf->data[0] << 8);
+	default:
+		return (0);
+	}
+}
+
+/* Try to coalesce a frame sent to 'nd' units. Return true if the frame
+ * replaced the last event of its channel on all of them, else make it the
+ * last one.
+ */
+static bool
+jack_midi_coalesce (const midi_qframe_t *qf, const int *dst, int nd,
+			uint32_t key)
 {
+	int ch = qf->data[0] & 0x0f;
+	jack_midi_coal_t *e;
+	int i;
+
+	for (i = 0; key != 0 && i < nd; i++) {
+		e = &coal[dst[i]][ch];
+		if (e->cycle != coal_cycle || e->key != key || e->ev == NULL)
+			break;
+	}
+	if (key != 0 && nd > 0 && i == nd) {
+		/* newer value for the last events of the channel, which
+		 * keep their place */
+		for (i = 0; i < nd; i++)
+			memcpy (coal[dst[i]][ch].ev, qf->data, qf->len);
+		return (true);
+	}
+	/* whatever its source, it comes after the last events */
+	for (i = 0; i < nd; i++) {
+		e = &coal[dst[i]][ch];
+		e->cycle = coal_cycle;
+		e->key = key;
+		e->ev = NULL;
+	}
+	return (false);
+}
+
+static void
+jack_midi_read (jack_nframes_t nframes, jack_time_t now)
+{
+	uint32_t key;
+	const midi_qframe_t *qf;
+	jack_nframes_t start, prev, off = 0;
+	void *buf[JACK_OUT_MAX];
+	int count[JACK_OUT_MAX];
+	int dst[2];
 	uint8_t *buffer;
-	void *buf;
-	midi_frame_t *mf;
+	int i, nd, sh = 0;
 
-	if ( ! midi_reader_update (&reader))
-		return;
+	for (i = 0; i < JACK_OUT_MAX; i++) {
+		count[i] = 0;
+		if (output_port[i] == NULL)
+			buf[i] = NULL;
+		else {
+			buf[i] = jack_port_get_buffer (output_port[i], nframes);
+			if (buf[i] != NULL)
+				jack_midi_clear_buffer (buf[i]);
+			else {
+				DPRINTF ("jack: cannot send anything on "
+						"unit %d.\n", i);
+			}
+		}
+	}
+	start = jack_last_frame_time (jack_client);
+	/* the period may have changed since the previous one */
+	prev = prev_nframes ? prev_nframes : nframes;
+	prev_nframes = nframes;
+	/* frees the entries of the previous period */
+	if (++coal_cycle == 0)
+		coal_cycle = 1;
 
-	jack_midi_lock ();
+	/* only consume the reader queues filled by the reader threads, in
+	 * time order: no syscall nor lock here */
+	while ((qf = jack_midi_next (&sh)) != NULL) {
+		if (probe_count > 0 && jack_midi_probe_recv (qf)) {
+			batches[sh].pos++;
+			continue;
+		}
+		if (thru_only && qf->source < ndevs && devs[qf->source].thru &&
+						qf->len <= MIDI_FRAME_MAX) {
+			/* already sent to the devices it is routed to; long
+			 * system exclusive frames are not routed */
+			batches[sh].pos++;
+			continue;
+		}
+		/* all frames to unit 0, and to the unit of their source */
+		nd = 0;
+		if (buf[0] != NULL)
+			dst[nd++] = 0;
+		if (qf->source < JACK_OUT_MAX - 1 && buf[qf->source + 1])
+			dst[nd++] = qf->source + 1;
+		if ( ! jack_midi_room (buf, count, dst, nd, qf->len)) {
+			/* Jack buffer full, keep the frame for next period */
+			JACK_MIDI_ADD (metrics.deferred, 1);
+			break;
+		}
+		jack_midi_hist (metrics.dwell_hist,
+				now > qf->time ? now - qf->time : 0);
+		key = 0;
+		if (coalesce && qf->data[0] >= 0x80 && qf->data[0] <= 0xef) {
+			key = jack_midi_coal_key (qf);
+			if (jack_midi_coalesce (qf, dst, nd, key)) {
+				JACK_MIDI_ADD (metrics.coalesced, 1);
+				batches[sh].pos++;
+				continue;
+			}
+		}
+		off = jack_midi_offset (qf->time, start, prev, nframes, off);
+		for (i = 0; i < nd; i++) {
+			buffer = jack_midi_event_reserve (buf[dst[i]], off,
+								qf->len);
+			if (buffer != NULL) {
+				memcpy (buffer, qf->data, qf->len);
+				count[dst[i]]++;
+				if (key != 0)
+					coal[dst[i]][qf->data[0] & 0x0f].ev =
+								buffer;
+			}
+			else {
+				/* too long for an empty Jack buffer */
+				JACK_MIDI_ADD (metrics.tx_lost[dst[i]], 1);
+				DPRINTF ("Frame too long. MIDI event lost\n");
+			}
+		}
+		batches[sh].pos++;
+	}
+	jack_midi_done ();
+	if (probe_count > 0)
+		jack_midi_probe_recv (NULL);
+}
 
-	if (output_port[0] == NULL)
-		buf = NULL;
-	else {
-		buf = jack_port_get_buffer (output_port[0], nframes);
-		if (buf != NULL)
-			jack_midi_clear_buffer(buf);
+/* Reader callback, in the thread of a shard: queue a frame for the
+ * playback devices its source is routed to (-T), written at once by the
+ * writer thread. The frame is stored for Jack too.
+ */
+static midi_frame_state_t
+jack_midi_thru (midi_frame_t *mf, void *arg)
+{
+	jack_midi_shard_t *sh = arg;
+	jack_ringbuffer_t *rb;
+	uint64_t thru;
+
+	if (mf->source >= ndevs)
+		return (MIDIF_COMPLETE);
+	for (thru = devs[mf->source].thru; thru != 0; thru &= thru - 1) {
+		rb = devs[__builtin_ctzll (thru)].thru_rb[sh - shards];
+		if (jack_midi_out_put (rb, mf->data, mf->len))
+			sh->thru_pending = 1;
 		else {
-			DPRINTF ("jack: cannot send anything on unit.\n");
+			__atomic_fetch_add (&devs[__builtin_ctzll (thru)].
+					thru_lost, 1, __ATOMIC_RELAXED);
 		}
 	}
-	if (buf == NULL)
-		DPRINTF ("Buffer full. MIDI event lost\n");
-	else {
-		while (1) {
-			mf = midi_reader_get_next (&reader);
-			if (mf == NULL)
-				break;
-			buffer = jack_midi_event_reserve (buf,
-						jack_counter, mf->len);
-			if (buffer == NULL)
+	return (MIDIF_COMPLETE);
+}
+
+/* Update the descriptors watched by a reader thread. Called locked. */
+static void
+jack_midi_reader_sync (jack_midi_shard_t *sh)
+{
+	midi_reader_t *reader = &sh->reader;
+	int i, j, fd;
+
+	for (i = 0; i < sh->evq.nfds; ) {
+		fd = sh->evq.fds[i];
+		for (j = 0; j < reader->nsources; j++) {
+			if (reader->sources[j].fd == fd)
 				break;
-			jack_counter++;
-			memcpy (buffer, mf->data, mf->len);
-			if (debug_mode) {
-				dprintf (2, "frame#%i sent to jack: ",
-					jack_counter);
-				midi_frame_dump (mf, 2);
-				dprintf (2, "\n");
+		}
+		if (j < reader->nsources)
+			i++;
+		else
+			evq_remove (&sh->evq, fd);
+	}
+	for (j = 0; j < reader->nsources; j++)
+		evq_add (&sh->evq, reader->sources[j].fd);
+}
+
+/* Thread reading the MIDI-in devices of a shard: wait for data and parse
+ * it. Its reader queue is consumed by the Jack thread. Shards share no
+ * lock, so that they run in parallel.
+ */
+static void *
+jack_midi_reader_thread (void *arg)
+{
+	jack_midi_shard_t *sh = arg;
+	evq_event_t ev[EVQ_MAX];
+	int gen = -1;
+	int i, j, n;
+
+	while (1) {
+		pthread_mutex_lock (&sh->mtx);
+		if (gen != sh->gen) {
+			jack_midi_reader_sync (sh);
+			gen = sh->gen;
+		}
+		pthread_mutex_unlock (&sh->mtx);
+
+		n = evq_wait (&sh->evq, ev, EVQ_MAX, -1);
+		if (n < 0) {
+			DPRINTF ("evq_wait() failed.\n");
+			usleep (JACK_MIDI_HOTPLUG_MS * 1000);
+			continue;
+		}
+
+		pthread_mutex_lock (&sh->mtx);
+		for (i = 0; i < n; i++) {
+			if ( ! (ev[i].type & EVQ_ERROR))
+				continue;
+			/* stop watching it, main loop will close it */
+			evq_remove (&sh->evq, ev[i].fd);
+			for (j = 0; j < ndevs; j++) {
+				if (&shards[devs[j].shard] == sh &&
+				    devs[j].read_fd == ev[i].fd)
+					devs[j].read_lost = 1;
 			}
+			evq_wakeup (&main_evq);
 		}
+		do {
+			midi_reader_update (&sh->reader);
+		} while (midi_reader_pending (&sh->reader));
+		if (sh->thru_pending) {
+			sh->thru_pending = 0;
+			evq_wakeup (&writer_evq);
+		}
+		/* the main loop writes the dump */
+		if (midi_reader_dump_pending (&sh->reader) > JACK_MIDI_DUMP_WAKE)
+			evq_wakeup (&main_evq);
+		/* nobody consumes the queue before the first Jack client; it is
+		 * kept for a reconnected one, up to the queue size */
+		if ( ! sh->consumed)
+			midi_reader_clear_queue (&sh->reader);
+		pthread_mutex_unlock (&sh->mtx);
 	}
 
-	jack_midi_unlock ();
+	/* not reached */
+	return (NULL);
+}
+
+/* Thread replaying a capture in log format thru the reader, at
+ * 'replay_speed' times the original speed.
+ */
+static void *
+jack_midi_replay_thread (void *arg)
+{
+	midi_log_frame_t f;
+	midi_frame_t mf;
+	uint64_t first = 0;
+	jack_time_t start = 0, now;
+	double due;
+	unsigned long sent = 0, skipped = 0;
+	int r, n;
+
+	/* the queue is not consumed until there is a Jack client */
+	while (1) {
+		jack_midi_lock ();
+		n = jack_client != NULL;
+		jack_midi_unlock ();
+		if (n)
+			break;
+		usleep (JACK_MIDI_HOTPLUG_MS * 1000);
+	}
+
+	while ((r = midi_log_next (&replay_log, &f)) == 1) {
+		if (f.len == 0 || f.len > MIDI_FRAME_MAX) {
+			/* long system exclusive, cannot be injected */
+			skipped++;
+			continue;
+		}
+		if (sent + skipped == 0) {
+			first = f.time;
+			start = jack_get_time ();
+		}
+		if (replay_speed > 0) {
+			due = (int64_t) (f.time - first) / replay_speed;
+			now = jack_get_time () - start;
+			if (due > now)
+				usleep ((useconds_t) (due - now));
+		}
+		mf.time = 0;
+		mf.len = f.len;
+		memcpy (mf.data, f.data, f.len);
+		/* serialized with the reader thread, the other producer */
+		pthread_mutex_lock (&shards[0].mtx);
+		n = midi_reader_inject_from (&shards[0].reader, &mf, f.source);
+		if (shards[0].thru_pending) {
+			shards[0].thru_pending = 0;
+			evq_wakeup (&writer_evq);
+		}
+		pthread_mutex_unlock (&shards[0].mtx);
+		if (n == (int) f.len)
+			sent++;
+		else
+			skipped++;
+	}
+	if (r < 0)
+		warnx ("Capture file %s is truncated or corrupted.",
+			replay_path);
+	warnx ("Replay over, %lu frames sent, %lu skipped.", sent, skipped);
+	__atomic_store_n (&replay_done, 1, __ATOMIC_RELEASE);
+	evq_wakeup (&main_evq);
+	return (NULL);
+}
+
+/* Map the capture to replay in memory. */
+static void
+jack_midi_replay_open (void)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open (replay_path, O_RDONLY);
+	if (fd < 0 || fstat (fd, &st) != 0)
+		err (EX_NOINPUT, "Cannot open %s", replay_path);
+	p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED ||
+			! midi_log_open (&replay_log, p, st.st_size))
+		errx (EX_DATAERR, "%s is not a capture file.", replay_path);
+	madvise (p, st.st_size, MADV_SEQUENTIAL);
+	close (fd);
 }
 
 static int
 jack_midi_process_callback (jack_nframes_t nframes, void *reserved)
 {
+	jack_time_t t = jack_get_time ();
+
 	if (nframes) {
-		jack_midi_read (nframes);
+		jack_midi_read (nframes, t);
 		jack_midi_write (nframes);
 	}
+	t = jack_get_time () - t;
+	JACK_MIDI_ADD (metrics.cycles, 1);
+	JACK_MIDI_ADD (metrics.cycle_time, t);
+	if (t > metrics.cycle_max)
+		JACK_MIDI_SET (metrics.cycle_max, t);
+	jack_midi_hist (metrics.cycle_hist, t);
+	return (0);
+}
+
+/* Open the stats socket, watched by the main loop. */
+static void
+jack_midi_stats_open (void)
+{
+	struct sockaddr_un sun;
+
+	memset (&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen (stats_path) >= sizeof (sun.sun_path))
+		errx (EX_USAGE, "Stats socket path too long.");
+	strcpy (sun.sun_path, stats_path);
+	unlink (stats_path);
+	stats_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (stats_fd < 0 ||
+		bind (stats_fd, (struct sockaddr*) &sun, sizeof (sun)) != 0 ||
+			listen (stats_fd, 4) != 0)
+		err (EX_OSERR, "Could not create stats socket %s", stats_path);
+	fcntl (stats_fd, F_SETFL, O_NONBLOCK);
+	if ( ! evq_add (&main_evq, stats_fd))
+		errx (EX_OSERR, "Could not watch stats socket.");
+}
+
+static void
+jack_midi_stats_hist (int fd, const char *name, const uint64_t *hist)
+{
+	dprintf (fd, "%s", name);
+	for (int b = 0; b < JACK_MIDI_HIST_MAX; b++) {
+		dprintf (fd, " %llu",
+			(unsigned long long) JACK_MIDI_GET (hist[b]));
+	}
+	dprintf (fd, "\n");
+}
+
+static void
+jack_midi_stats_counters (int fd, const char *name,
+				const midi_reader_stats_t *st)
+{
+	dprintf (fd, "%s.read %lu\n%s.errors %lu\n%s.skipped %lu\n"
+		"%s.missed %lu\n%s.interleaved %lu\n%s.dump_lost %lu\n",
+		name, st->read, name, st->errors, name, st->skipped,
+		name, st->missed, name, st->interleaved, name, st->dump_lost);
+}
+
+/* Add the counters of 'st' to 'total'. */
+static void
+jack_midi_stats_add (midi_reader_stats_t *total, const midi_reader_stats_t *st)
+{
+	total->read += st->read;
+	total->errors += st->errors;
+	total->skipped += st->skipped;
+	total->missed += st->missed;
+	total->interleaved += st->interleaved;
+	total->dump_lost += st->dump_lost;
+}
+
+/* Write the metrics to a client of the stats socket, one "<key> <value>"
+ * per line, and close the connection.
+ */
+static void
+jack_midi_stats_serve (void)
+{
+	midi_reader_stats_t st[JACK_MIDI_DEV_MAX], total = { 0 };
+	bool has_st[JACK_MIDI_DEV_MAX] = { false };
+	int rfd[JACK_MIDI_DEV_MAX], wfd[JACK_MIDI_DEV_MAX];
+	struct timeval tv = { 0, 100000 };
+	uint32_t used = 0, high = 0, size = 0, u, h;
+	uint64_t cycles;
+	char name[32];
+	midi_reader_t *reader;
+	int fd, i, j, id;
+
+	fd = accept (stats_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+	for (j = 0; j < nshards; j++) {
+		reader = &shards[j].reader;
+		pthread_mutex_lock (&shards[j].mtx);
+		jack_midi_stats_add (&total, &reader->total);
+		for (i = 0; i < reader->nsources; i++) {
+			id = reader->sources[i].id;
+			if (id < ndevs)
+				has_st[id] = midi_reader_get_stats (reader, i,
+								&st[id]);
+		}
+		pthread_mutex_unlock (&shards[j].mtx);
+		/* all the queues, and the highest use of one */
+		midi_reader_get_queue_usage (reader, &u, &h);
+		used += u;
+		size += reader->frames.size;
+		if (h > high)
+			high = h;
+	}
+	jack_midi_lock ();
+	for (i = 0; i < ndevs; i++) {
+		rfd[i] = devs[i].read_fd;
+		wfd[i] = devs[i].write_fd;
+	}
+	jack_midi_unlock ();
+
+	cycles = JACK_MIDI_GET (metrics.cycles);
+	dprintf (fd, "version %s\nuptime %lld\njack.connected %d\n"
+		"jack.period %u\n", JACK_MIDI_VERSION,
+		(long long) (time (NULL) - start_time), jack_client != NULL,
+		(unsigned) JACK_MIDI_GET (jack_period));
+	dprintf (fd, "queue.count %d\nqueue.size %u\nqueue.used %u\n"
+		"queue.high %u\n", nshards, size, used, high);
+	dprintf (fd, "process.cycles %llu\nprocess.time_avg %llu\n"
+		"process.time_max %llu\n", (unsigned long long) cycles,
+		(unsigned long long) (cycles ?
+			JACK_MIDI_GET (metrics.cycle_time) / cycles : 0),
+		(unsigned long long) JACK_MIDI_GET (metrics.cycle_max));
+	jack_midi_stats_hist (fd, "process.time_hist", metrics.cycle_hist);
+	jack_midi_stats_hist (fd, "dwell.hist", metrics.dwell_hist);
+	dprintf (fd, "jack.deferred %llu\njack.coalesced %llu\n",
+		(unsigned long long) JACK_MIDI_GET (metrics.deferred),
+		(unsigned long long) JACK_MIDI_GET (metrics.coalesced));
+	for (i = 0; i < JACK_OUT_MAX; i++) {
+		if (output_port[i] == NULL)
+			continue;
+		dprintf (fd, "unit.%d.lost %llu\n", i, (unsigned long long)
+			JACK_MIDI_GET (metrics.tx_lost[i]));
+	}
+	jack_midi_stats_counters (fd, "total", &total);
+	for (i = 0; i < ndevs; i++) {
+		snprintf (name, sizeof (name), "device.%d", i);
+		dprintf (fd, "%s.name %s\n", name,
+			jack_midi_dev_name (&devs[i]));
+		if (devs[i].read_name) {
+			dprintf (fd, "%s.capture %s\n", name,
+				rfd[i] > -1 ? "open" : "closed");
+		}
+		if (devs[i].write_name) {
+			dprintf (fd, "%s.playback %s\n", name,
+				wfd[i] > -1 ? "open" : "closed");
+			dprintf (fd, "%s.out_lost %lu\n%s.out_high %u\n", name,
+				JACK_MIDI_GET (devs[i].out_lost), name,
+				(unsigned) JACK_MIDI_GET (devs[i].out_high));
+			if (devs[i].thru_rb[0] != NULL) {
+				dprintf (fd, "%s.thru_lost %lu\n", name,
+					JACK_MIDI_GET (devs[i].thru_lost));
+			}
+		}
+		if (has_st[i])
+			jack_midi_stats_counters (fd, name, &st[i]);
+	}
+	close (fd);
+}
+
+/* Jack buffer size callback, not called in the process thread. */
+static int
+jack_midi_buffer_size_callback (jack_nframes_t nframes, void *arg)
+{
+	__atomic_store_n (&jack_period, nframes, __ATOMIC_RELAXED);
+	if (debug_mode)
+		dprintf (2, "Jack period is %u frames\n", (unsigned) nframes);
 	return (0);
 }
 
 static void
 jack_midi_jack_shutdown (void *arg)
 {
-	midi_reader_close (&reader);
-	close (write_fd);
+	if (stats_fd > -1)
+		unlink (stats_path);
+	for (int i = 0; i < nshards; i++)
+		midi_reader_close (&shards[i].reader);
+	for (int i = 0; i < ndevs; i++) {
+		if (devs[i].write_fd > -1)
+			close (devs[i].write_fd);
+	}
 	exit (0);
 }
 
+/* Jack shutdown callback: let the main loop reconnect. */
 static void
-jack_midi_openclose (void)
+jack_midi_jack_shutdown_cb (void *arg)
 {
-	if (read_name) {
-		if (read_fd < 0) {
-			read_fd = open (read_name, O_RDONLY | O_NONBLOCK);
-			if (read_fd > -1) {
+	jack_shutdown = 1;
+	evq_wakeup (&main_evq);
+}
+
+/* Close the client of a Jack server which went away, so that it is
+ * created again by the main loop. The reader and the devices are kept.
+ */
+static void
+jack_midi_close_client (void)
+{
+	jack_client_t *client = jack_client;
+
+	/* stops the process thread, ports are freed with the client */
+	jack_client_close (client);
+	jack_midi_lock ();
+	jack_client = NULL;
+	jack_lost = 1;
+	for (int i = 0; i < JACK_OUT_MAX; i++)
+		output_port[i] = NULL;
+	for (int i = 0; i < ndevs; i++)
+		devs[i].input_port = NULL;
+	prev_nframes = 0;
+	jack_midi_unlock ();
+	warnx ("Jack server went away, waiting for it.");
+}
+
+/* Delay the next open attempt of a device, doubling the delay each time
+ * up to JACK_MIDI_BACKOFF_MAX.
+ */
+static void
+jack_midi_backoff (jack_midi_dev_t *dev, jack_time_t now)
+{
+	dev->retry_at = now + (jack_time_t) dev->retry_ms * 1000;
+	dev->retry_ms *= 2;
+	if (dev->retry_ms > JACK_MIDI_BACKOFF_MAX)
+		dev->retry_ms = JACK_MIDI_BACKOFF_MAX;
+}
+
+/* Close the lost sides of a device and try to open the missing ones when
+ * 'changed' (a device directory changed) or when the backoff delay is
+ * over. Returns true if a side is still missing.
+ */
+static bool
+jack_midi_openclose_dev (jack_midi_dev_t *dev, jack_time_t now, bool changed)
+{
+	jack_midi_shard_t *sh;
+	bool retry, missing = false;
+	int fd;
+
+	if (changed)
+		dev->retry_ms = JACK_MIDI_BACKOFF_MIN;
+	retry = changed || now >= dev->retry_at;
+
+	if (dev->read_name) {
+		sh = &shards[dev->shard];
+		jack_midi_lock ();
+		pthread_mutex_lock (&sh->mtx);
+		if (dev->read_lost) {
+			DPRINTF ("Close read\n");
+			midi_reader_remove_source (&sh->reader, dev->read_fd);
+			dev->read_fd = -1;
+			dev->read_lost = 0;
+			sh->gen++;
+			/* it may come back at once */
+			retry = true;
+		}
+		pthread_mutex_unlock (&sh->mtx);
+		jack_midi_unlock ();
+		if (dev->read_fd < 0 && retry) {
+			fd = open (dev->read_name, O_RDONLY | O_NONBLOCK);
+			if (fd > -1) {
 				jack_midi_lock ();
-				midi_reader_add_source (&reader, read_fd, 0);
+				pthread_mutex_lock (&sh->mtx);
+				dev->read_fd = fd;
+				midi_reader_add_source (&sh->reader, fd, 0);
+				midi_reader_set_source_id (&sh->reader, fd,
+							dev - devs);
+				if (dev->transform != NULL &&
+				    ! midi_reader_set_transform (&sh->reader, fd,
+							dev->transform))
+					warnx ("Could not set the transform of "
+					    "%s.", jack_midi_dev_name (dev));
+				sh->gen++;
+				pthread_mutex_unlock (&sh->mtx);
 				jack_midi_unlock ();
+				evq_wakeup (&sh->evq);
 			}
 		}
-		else if (midi_reader_poll (&reader) < 0) {
-			DPRINTF ("Close read\n");
-			jack_midi_lock ();
-			midi_reader_close (&reader);
-			read_fd = -1;
-			jack_midi_unlock ();
-		}
+		if (dev->read_fd < 0)
+			missing = true;
 	}
 
-	if (write_name) {
-		if (write_fd < 0) {
-			jack_midi_lock ();
-			write_fd = open (write_name, O_WRONLY | O_NONBLOCK);
-			jack_midi_unlock ();
-		}
-		else if (fcntl (write_fd, F_SETFL, (int) O_NONBLOCK) < 0) {
+	if (dev->write_name) {
+		/* an idle playback device is only checked on changes */
+		if (dev->write_fd > -1 && (dev->write_lost ||
+		    ((changed || ! dev_watch) &&
+		    fcntl (dev->write_fd, F_SETFL, (int) O_NONBLOCK) < 0))) {
 			DPRINTF ("Close write\n");
 			jack_midi_lock ();
-			close (write_fd);
-			write_fd = -1;
+			close (dev->write_fd);
+			dev->write_fd = -1;
+			dev->write_lost = 0;
 			jack_midi_unlock ();
+			retry = true;
+		}
+		if (dev->write_fd < 0 && retry) {
+			fd = open (dev->write_name, O_WRONLY | O_NONBLOCK);
+			if (fd > -1) {
+				jack_midi_lock ();
+				dev->write_fd = fd;
+				dev->out_running = 0;
+				jack_midi_unlock ();
+			}
 		}
+		if (dev->write_fd < 0)
+			missing = true;
+	}
+
+	if ( ! missing) {
+		dev->retry_at = 0;
+		dev->retry_ms = JACK_MIDI_BACKOFF_MIN;
+	}
+	else if (retry)
+		jack_midi_backoff (dev, now);
+	return (missing);
+}
+
+/* Check the devices, see "jack_midi_openclose_dev". Returns the delay in
+ * ms until the next open attempt, or -1 if all the devices are open.
+ */
+static int
+jack_midi_openclose (bool changed)
+{
+	jack_time_t now = jack_get_time (), next = 0;
+	int i;
+
+	for (i = 0; i < ndevs; i++) {
+		if (jack_midi_openclose_dev (&devs[i], now, changed) &&
+		    (next == 0 || devs[i].retry_at < next))
+			next = devs[i].retry_at;
 	}
 
 	/* check if we should close */
 	if (kill_on_close != 0) {
 		int stop = 0;
 
-		if (write_name != NULL && write_fd == -1)
-			stop = 1;
-		if (read_name != NULL && read_fd == -1)
-			stop = 1;
+		for (i = 0; i < ndevs; i++) {
+			if (devs[i].write_name != NULL && devs[i].write_fd == -1)
+				stop = 1;
+			if (devs[i].read_name != NULL && devs[i].read_fd == -1)
+				stop = 1;
+		}
 		if (stop)
 			jack_midi_jack_shutdown (NULL);
 	}
+
+	if (next == 0)
+		return (-1);
+	else if (next <= now)
+		return (0);
+	return ((int) ((next - now + 999) / 1000));
+}
+
+/* Watch the directories of the devices, so that a device node appearing
+ * is opened at once instead of after the backoff delay.
+ */
+static void
+jack_midi_watch_devs (void)
+{
+	char *dirs[2 * JACK_MIDI_DEV_MAX], *name, *p;
+	int i, j, n = 0;
+
+	dev_watch = true;
+	for (i = 0; i < 2 * ndevs; i++) {
+		name = (i & 1) ? devs[i / 2].write_name : devs[i / 2].read_name;
+		if (name == NULL)
+			continue;
+		p = strrchr (name, '/');
+		if (p == NULL)
+			dirs[n] = strdup (".");
+		else if (p == name)
+			dirs[n] = strdup ("/");
+		else
+			dirs[n] = strndup (name, p - name);
+		if (dirs[n] == NULL)
+			errx (EX_OSERR, "Out of memory.");
+		for (j = 0; j < n && strcmp (dirs[j], dirs[n]) != 0; j++)
+			;
+		if (j < n) {
+			free (dirs[n]);
+			continue;
+		}
+		if ( ! evq_watch (&main_evq, dirs[n])) {
+			DPRINTF ("Cannot watch %s\n", dirs[n]);
+			dev_watch = false;
+		}
+		n++;
+	}
+	while (n > 0)
+		free (dirs[--n]);
+}
+
+/* Parse "<n>" or "<lo>-<hi>", with values between 'min' and 'max'. */
+static bool
+jack_midi_range (const char *s, long min, long max, int *lo, int *hi)
+{
+	char *endptr;
+	long l, h;
+
+	l = strtol (s, &endptr, 0);
+	if (endptr == s)
+		return (false);
+	if (*endptr == '-') {
+		s = endptr + 1;
+		h = strtol (s, &endptr, 0);
+		if (endptr == s)
+			return (false);
+	}
+	else
+		h = l;
+	if (*endptr || l < min || h > max || l > h)
+		return (false);
+	*lo = (int) l;
+	*hi = (int) h;
+	return (true);
+}
+
+/* Parse a single value between 'min' and 'max'. */
+static bool
+jack_midi_value (const char *s, long min, long max, int *v)
+{
+	int hi;
+
+	return (s != NULL && jack_midi_range (s, min, max, v, &hi) && *v == hi);
+}
+
+/* Apply a -f (status bytes) or -F (controllers) filter option. */
+static void
+jack_midi_filter (midi_reader_t *reader, const char *arg, bool cc)
+{
+	const char *p;
+	char *endptr;
+	int ch = 0, lo, hi;
+	long l;
+	bool ok;
+
+	if (cc) {
+		/* [<channel>:]<lo>[-<hi>] */
+		p = strchr (arg, ':');
+		if (p != NULL) {
+			l = strtol (arg, &endptr, 0);
+			ok = endptr != arg && endptr == p && l >= 1 && l <= 16;
+			ch = (int) l;
+		}
+		else
+			ok = true;
+		ok = ok && jack_midi_range (p ? p + 1 : arg, 0, 127, &lo, &hi) &&
+			midi_reader_filter_cc (reader, ch, lo, hi);
+	}
+	else if (strncmp (arg, "ch:", 3) == 0) {
+		ok = jack_midi_range (arg + 3, 1, 16, &ch, &hi) &&
+			ch == hi && midi_reader_filter_channel (reader, ch);
+	}
+	else {
+		ok = jack_midi_range (arg, 0x80, 0xff, &lo, &hi) &&
+			midi_reader_filter_status (reader, lo, hi);
+	}
+	if ( ! ok)
+		errx (EX_USAGE, "bad argument for -%c (%s)", cc ? 'F' : 'f', arg);
+}
+
+/* Find the device with a capture (or playback) path, with or without its
+ * /dev/ prefix, of 'len' bytes. Return its index or -1.
+ */
+static int
+jack_midi_find_dev (const char *name, size_t len, bool playback)
+{
+	const char *path;
+
+	for (int i = 0; i < ndevs; i++) {
+		path = playback ? devs[i].write_name : devs[i].read_name;
+		if (path == NULL)
+			continue;
+		if (strncmp (path, "/dev/", 5) == 0 &&
+		    strncmp (name, "/dev/", 5) != 0)
+			path += 5;
+		if (strlen (path) == len && strncmp (path, name, len) == 0)
+			return (i);
+	}
+	return (-1);
+}
+
+/* Apply a -X option: add to the transform of a capture device,
+ * <capture>=<spec>[,<spec>...], with the specs ch:[<n>=]<m>,
+ * vel:<lo>[-<hi>], tr:<semitones>, split:<lo>[-<hi>]:<channel> and
+ * cc:<n>=<m>.
+ */
+static void
+jack_midi_transform (const char *arg)
+{
+	const char *eq = strchr (arg, '=');
+	midi_reader_transform_t *xf;
+	char *specs, *spec, *v, *w, *p;
+	int dev = -1, lo, hi, n;
+	bool ok = true;
+
+	if (eq != NULL)
+		dev = jack_midi_find_dev (arg, eq - arg, false);
+	if (dev < 0)
+		errx (EX_USAGE, "bad argument for -X (%s)", arg);
+	if (devs[dev].transform == NULL) {
+		devs[dev].transform = malloc (sizeof (midi_reader_transform_t));
+		if (devs[dev].transform == NULL)
+			errx (EX_OSERR, "Out of memory.");
+		midi_reader_transform_init (devs[dev].transform);
+	}
+	xf = devs[dev].transform;
+	specs = strdup (eq + 1);
+	if (specs == NULL)
+		errx (EX_OSERR, "Out of memory.");
+	for (p = specs; ok && (spec = strsep (&p, ",")) != NULL; ) {
+		v = strchr (spec, ':');
+		if (v == NULL) {
+			ok = false;
+			break;
+		}
+		*v++ = '\0';
+		w = strchr (v, strcmp (spec, "split") == 0 ? ':' : '=');
+		if (w != NULL)
+			*w++ = '\0';
+		if (strcmp (spec, "ch") == 0 && w == NULL) {
+			ok = jack_midi_value (v, 1, 16, &n) &&
+				midi_reader_transform_channel (xf, 0, n);
+		}
+		else if (strcmp (spec, "ch") == 0) {
+			ok = jack_midi_value (v, 1, 16, &lo) &&
+				jack_midi_value (w, 1, 16, &n) &&
+				midi_reader_transform_channel (xf, lo, n);
+		}
+		else if (strcmp (spec, "vel") == 0) {
+			ok = w == NULL &&
+				jack_midi_range (v, 1, 127, &lo, &hi) &&
+				midi_reader_transform_velocity (xf, lo, hi);
+		}
+		else if (strcmp (spec, "tr") == 0) {
+			ok = w == NULL && jack_midi_value (v, -127, 127, &n) &&
+				midi_reader_transform_transpose (xf, n);
+		}
+		else if (strcmp (spec, "split") == 0) {
+			ok = jack_midi_range (v, 0, 127, &lo, &hi) &&
+				jack_midi_value (w, 1, 16, &n) &&
+				midi_reader_transform_split (xf, lo, hi, n);
+		}
+		else if (strcmp (spec, "cc") == 0) {
+			ok = jack_midi_value (v, 0, 127, &lo) &&
+				jack_midi_value (w, 0, 127, &n) &&
+				midi_reader_transform_cc (xf, lo, n);
+		}
+		else
+			ok = false;
+	}
+	free (specs);
+	if ( ! ok)
+		errx (EX_USAGE, "bad argument for -X (%s)", arg);
+}
+
+/* Apply a -T option: route the frames of a capture device to a playback
+ * device, <capture>:<playback>.
+ */
+static void
+jack_midi_route (const char *arg)
+{
+	const char *p = strrchr (arg, ':');
+	int src = -1, dst = -1;
+
+	if (p != NULL) {
+		src = jack_midi_find_dev (arg, p - arg, false);
+		dst = jack_midi_find_dev (p + 1, strlen (p + 1), true);
+	}
+	if (src < 0 || dst < 0)
+		errx (EX_USAGE, "bad argument for -T (%s)", arg);
+	devs[src].thru |= 1ULL << dst;
 }
 
 static void
@@ -260,18 +1707,40 @@ usage (const char *msg)
 {
 	dprintf (2,
 	"jack_midi v%s - Jack MIDI socket client\n"
-	"    -d </dev/xxx> set capture and playback device\n"
-	"    -C </dev/xxx> set capture device only\n"
-	"    -P </dev/xxx> set playback device only\n"
+	"    -d </dev/xxx> add a capture and playback device\n"
+	"    -C </dev/xxx> add a capture-only device\n"
+	"    -P </dev/xxx> add a playback-only device\n"
 	"    -U <username> attach to this JACK user\n"
 	"    -B run in background\n"
 	"    -k terminate client if a device goes away\n"
 	"    -n <port> specify Jack port name: default is jack_midi_...\n"
 	"    -g show trames (debug mode)\n"
 	"    -x expand running status MIDI frames\n"
-	"    -f <n> filter-out frames with status byte <n>\n"
+	"    -r use running status on playback devices\n"
+	"    -f <n>[-<m>] filter-out frames with status byte <n> (to <m>)\n"
+	"    -f ch:<n> filter-out channel messages of channel <n>\n"
+	"    -F [<ch>:]<n>[-<m>] filter-out controllers <n> (to <m>)\n"
 	"    -m <file> dump frames to <file> (descriptor or path)\n"
 	"    -M <file> dump frames to <file> (descriptor or path), hex mode\n"
+	"    -l <file> dump frames to <file> (descriptor or path), binary\n"
+	"       capture format with timestamps and sources\n"
+	"    -R <file> replay a capture made with -l to the capture ports\n"
+	"    -A <speed> replay speed factor (default 1, 0 for no delay)\n"
+	"    -s <path> serve metrics on UNIX socket <path>\n"
+	"    -b <frames> set the Jack buffer size, for all the clients\n"
+	"    -j <count> parse the capture devices with <count> threads\n"
+	"    -p <prio> run the I/O threads with SCHED_FIFO priority <prio>\n"
+	"    -c <n>[-<m>][,...] run the I/O threads on these CPUs\n"
+	"    -w lock the memory of the process (mlockall)\n"
+	"    -o coalesce controllers, pressure and pitch bend by period\n"
+	"    -T <capture>:<playback> send the frames of a capture device to\n"
+	"       a playback device at once, not thru Jack\n"
+	"    -t do not send the frames routed by -T to Jack\n"
+	"    -X <capture>=<spec>[,...] transform the channel messages of a\n"
+	"       capture device: ch:[<n>=]<m> vel:<lo>[-<hi>] tr:<semitones>\n"
+	"       split:<lo>[-<hi>]:<channel> cc:<n>=<m>\n"
+	"    -L <count> loopback test: time <count> probes sent to the first\n"
+	"       capture and playback device and read back, then exit\n"
 	"    -h (show help)\n",
 	JACK_MIDI_VERSION);
 	if (msg)
@@ -292,42 +1761,50 @@ jack_midi_log_callback (const char *desc)
 static void
 jack_midi_create_client (int background)
 {	
+	jack_client_t *client;
 	char *devname;
+	char pname[256];
+	bool has_capture = replay_path != NULL;
 	int error;
+	int i;
 
 	if (jack_client)
 		return;
 
 	if (port_name)
 		devname = strdup (port_name);
+	else if (ndevs != 1)
+		devname = strdup (JACK_PORT_NAME);
 	else {
-		const char *pname;
+		const char *pname = jack_midi_dev_name (&devs[0]);
 		int len;
 
-		if (read_name != NULL) {
-			if (strncmp (read_name, "/dev/", 5) == 0)
-				pname = read_name + 5;
-			else
-				pname = read_name;
-		}
-		else {
-			if (strncmp (write_name, "/dev/", 5) == 0)
-				pname = write_name + 5;
-			else
-				pname = write_name;
-		}
 		len = strlen (pname) + 2 + strlen (JACK_PORT_NAME);
 		devname = malloc (len);
-		snprintf (devname, len, "%s_%s", JACK_PORT_NAME, pname);
+		if (devname)
+			snprintf (devname, len, "%s_%s", JACK_PORT_NAME, pname);
 	}
 	if (devname == NULL)
 		errx (EX_OSERR, "Out of memory.");
 
-	jack_client = jack_client_open (devname, JackNoStartServer, NULL);
+	client = jack_client_open (devname, JackNoStartServer, NULL);
 	free (devname);
+
+	/* the reader threads clear their queue until there is a client */
+	jack_midi_lock ();
+	jack_client = client;
+	if (client != NULL)
+		jack_lost = 0;
+	jack_midi_unlock ();
+	for (i = 0; client != NULL && i < nshards; i++) {
+		pthread_mutex_lock (&shards[i].mtx);
+		shards[i].consumed = 1;
+		pthread_mutex_unlock (&shards[i].mtx);
+	}
+
 	if (jack_client == NULL) {
 		/* check status of MIDI device */
-		jack_midi_openclose ();
+		(void) jack_midi_openclose (false);
 	}
 	else {
 		error = jack_set_process_callback (jack_client,
@@ -337,10 +1814,39 @@ jack_midi_create_client (int background)
 					"JACK process callback.");
 		}
 
-		jack_set_buffer_size (jack_client, 64);
-		jack_on_shutdown (jack_client, jack_midi_jack_shutdown, 0);
+		error = jack_set_buffer_size_callback (jack_client,
+					jack_midi_buffer_size_callback, 0);
+		if (error) {
+			errx (EX_UNAVAILABLE, "Could not register "
+					"JACK buffer size callback.");
+		}
+		if (buffer_size > 0 && jack_set_buffer_size (jack_client,
+							buffer_size) != 0)
+			warnx ("Could not set Jack buffer size to %u frames.",
+				(unsigned) buffer_size);
+		jack_on_shutdown (jack_client, jack_midi_jack_shutdown_cb, 0);
 
-		if (read_name != NULL) {
+		for (i = 0; i < ndevs; i++) {
+			if (devs[i].read_name == NULL)
+				continue;
+			has_capture = true;
+			if (ndevs == 1)
+				break;
+			/* one capture port per device (unit i + 1) */
+			snprintf (pname, sizeof (pname), "%s.TX",
+				jack_midi_dev_name (&devs[i]));
+			output_port[i + 1] = jack_port_register (
+			jack_client, pname, JACK_DEFAULT_MIDI_TYPE,
+			JackPortIsOutput | JackPortIsPhysical |
+			JackPortIsTerminal, 0);
+
+			if (output_port[i + 1] == NULL) {
+				errx (EX_UNAVAILABLE, "Could not "
+				    "register JACK output port.");
+			}
+		}
+		if (has_capture) {
+			/* all devices (unit 0) */
 			output_port[0] = jack_port_register (
 			jack_client, ".TX", JACK_DEFAULT_MIDI_TYPE,
 			JackPortIsOutput | JackPortIsPhysical |
@@ -351,22 +1857,108 @@ jack_midi_create_client (int background)
 				    "register JACK output port.");
 			}
 		}
-		if (write_name != NULL) {
-			input_port = jack_port_register (
-			jack_client, ".RX", JACK_DEFAULT_MIDI_TYPE,
+		for (i = 0; i < ndevs; i++) {
+			if (devs[i].write_name == NULL)
+				continue;
+			/* one playback port per device */
+			if (ndevs == 1)
+				snprintf (pname, sizeof (pname), ".RX");
+			else {
+				snprintf (pname, sizeof (pname), "%s.RX",
+					jack_midi_dev_name (&devs[i]));
+			}
+			devs[i].input_port = jack_port_register (
+			jack_client, pname, JACK_DEFAULT_MIDI_TYPE,
 			JackPortIsInput | JackPortIsPhysical |
 			JackPortIsTerminal, 0);
 
-			if (input_port == NULL) {
+			if (devs[i].input_port == NULL) {
 				errx (EX_UNAVAILABLE, "Could not "
 				    "register JACK input port.");
 			}
 		}
 		if (jack_activate (jack_client))
 			errx (EX_UNAVAILABLE, "Cannot activate JACK client.");
+		__atomic_store_n (&jack_period,
+			jack_get_buffer_size (jack_client), __ATOMIC_RELAXED);
+	}
+}
+
+/* Parse the -c list of CPUs, "<n>[-<m>][,...]". */
+static void
+jack_midi_cpus (const char *arg)
+{
+	char *list, *tok, *last;
+	int lo, hi;
+
+	list = strdup (arg);
+	if (list == NULL)
+		errx (EX_OSERR, "Out of memory.");
+	ncpus = 0;
+	for (tok = strtok_r (list, ",", &last); tok != NULL;
+				tok = strtok_r (NULL, ",", &last)) {
+		if ( ! jack_midi_range (tok, 0, JACK_MIDI_CPU_LAST, &lo, &hi))
+			usage ("Bad CPU list.");
+		while (lo <= hi) {
+			if (ncpus == JACK_MIDI_CPU_MAX)
+				usage ("Too many CPUs.");
+			cpus[ncpus++] = lo++;
+		}
+	}
+	free (list);
+	if (ncpus == 0)
+		usage ("Bad CPU list.");
+}
+
+/* Apply the -p priority and -c CPUs to an I/O thread: the CPU at 'cpu'
+ * (modulo their count) in the list, or all of them if -1. Failures are
+ * only reported, the thread then runs with the default settings.
+ */
+static void
+jack_midi_rt_thread (pthread_t thread, const char *name, int cpu)
+{
+	struct sched_param param;
+
+	if (rt_prio > 0) {
+		memset (&param, 0, sizeof (param));
+		param.sched_priority = rt_prio;
+		if (pthread_setschedparam (thread, SCHED_FIFO, &param) != 0)
+			warnx ("Could not set real-time priority of %s thread.",
+				name);
+	}
+	if (ncpus > 0) {
+#ifdef JACK_MIDI_AFFINITY
+		jack_midi_cpuset_t set;
+
+		CPU_ZERO (&set);
+		if (cpu < 0) {
+			for (int i = 0; i < ncpus; i++)
+				CPU_SET (cpus[i], &set);
+		}
+		else
+			CPU_SET (cpus[cpu % ncpus], &set);
+		if (pthread_setaffinity_np (thread, sizeof (set), &set) != 0)
+			warnx ("Could not set CPU affinity of %s thread.", name);
+#else
+		warnx ("CPU affinity is not supported.");
+#endif
 	}
 }
 
+/* Size of the queue of a reader thread parsing 'n' capture devices: a
+ * few periods of data at full MIDI speed, the period being the -b one
+ * (the longest one without -b) at 44.1 kHz.
+ */
+static uint32_t
+jack_midi_queue_size (int n)
+{
+	uint64_t period = buffer_size ? buffer_size : JACK_MIDI_PERIOD_MAX;
+	uint64_t size = (uint64_t) n * JACK_MIDI_QUEUE_RATE *
+				JACK_MIDI_QUEUE_PERIODS * period / 44100;
+
+	return (size < JACK_MIDI_QUEUE_MIN ? JACK_MIDI_QUEUE_MIN : size);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -375,16 +1967,26 @@ main (int argc, char **argv)
 	int expand = 0;
 	int background = 0;
 	midi_reader_flags_t flags = 0;
-	unsigned char to_skip[256];
-	int skipped = 0;
+	const char *filters[JACK_MIDI_FILTER_MAX];
+	bool filters_cc[JACK_MIDI_FILTER_MAX];
+	int nfilters = 0;
+	const char *routes[JACK_MIDI_THRU_MAX];
+	int nroutes = 0;
+	const char *transforms[JACK_MIDI_XFORM_MAX];
+	int ntransforms = 0;
 	char *endptr;
 	long l;
 	char *dump_file = NULL;
 	int dump_hex = 0;
+	int dump_log = 0;
 	int start = 1;
+	int has_capture = 0;
+	int i, n, timeout, tick = 0;
+	bool dump = false, changed = false, lock_memory = false;
+	evq_event_t ev[4];
 
-	to_skip[0] = 0;
-	while ((c = getopt(argc, argv, "U:kBd:hP:SC:n:gxf:m:M:")) != -1) {
+	while ((c = getopt(argc, argv,
+			"U:kBd:hP:C:n:gxrf:F:m:M:l:R:A:L:b:s:j:p:c:woT:tX:")) != -1) {
 		switch (c) {
 		case 'k':
 			kill_on_close = 1;
@@ -393,18 +1995,16 @@ main (int argc, char **argv)
 			background = 1;
 			break;
 		case 'd':
-			free (read_name);
-			free (write_name);
-			read_name = strdup (optarg);
-			write_name = strdup (optarg);
+			if ( ! jack_midi_add_dev (optarg, optarg))
+				errx (EX_USAGE, "too many devices.");
 			break;
 		case 'P':
-			free (write_name);
-			write_name = strdup (optarg);
+			if ( ! jack_midi_add_dev (NULL, optarg))
+				errx (EX_USAGE, "too many devices.");
 			break;
 		case 'C':
-			free (read_name);
-			read_name = strdup (optarg);
+			if ( ! jack_midi_add_dev (optarg, NULL))
+				errx (EX_USAGE, "too many devices.");
 			break;
 		case 'n':
 			free (port_name);
@@ -420,17 +2020,29 @@ main (int argc, char **argv)
 		case 'x':
 			expand = 1;
 			break;
+		case 'r':
+			running_status = 1;
+			break;
 		case 'f':
-			if (skipped == 254) {
-				errx (EX_USAGE,
-					"too many skipped status bytes.");
-			}
-			l = strtol (optarg, &endptr, 0);
-			if (l < 0 || l > 255 || (endptr && *endptr)) {
-				errx (EX_USAGE, "bad argument for -f (%s)",
-					optarg);
-			}
-			to_skip[skipped++] = (unsigned char) l;
+		case 'F':
+			if (nfilters == JACK_MIDI_FILTER_MAX)
+				errx (EX_USAGE, "too many filters.");
+			filters_cc[nfilters] = (c == 'F');
+			filters[nfilters++] = optarg;
+			break;
+		case 'l':
+			dump_log = 1;
+			free (dump_file);
+			dump_file = strdup (optarg);
+			break;
+		case 'R':
+			free (replay_path);
+			replay_path = strdup (optarg);
+			break;
+		case 'A':
+			replay_speed = strtod (optarg, &endptr);
+			if (replay_speed < 0 || *endptr)
+				usage ("Bad replay speed.");
 			break;
 		case 'M':
 			dump_hex = 1;
@@ -439,6 +2051,57 @@ main (int argc, char **argv)
 			free (dump_file);
 			dump_file = strdup (optarg);
 			break;
+		case 's':
+			free (stats_path);
+			stats_path = strdup (optarg);
+			break;
+		case 'b':
+			l = strtol (optarg, &endptr, 0);
+			if (l < 16 || l > 8192 || (l & (l - 1)) || *endptr)
+				usage ("Bad buffer size.");
+			buffer_size = (jack_nframes_t) l;
+			break;
+		case 'j':
+			l = strtol (optarg, &endptr, 0);
+			if (l < 1 || l > JACK_MIDI_SHARD_MAX || *endptr)
+				usage ("Bad count of reader threads.");
+			nshards = (int) l;
+			break;
+		case 'p':
+			l = strtol (optarg, &endptr, 0);
+			if (l < sched_get_priority_min (SCHED_FIFO) ||
+			    l > sched_get_priority_max (SCHED_FIFO) || *endptr)
+				usage ("Bad real-time priority.");
+			rt_prio = (int) l;
+			break;
+		case 'c':
+			jack_midi_cpus (optarg);
+			break;
+		case 'w':
+			lock_memory = true;
+			break;
+		case 'o':
+			coalesce = 1;
+			break;
+		case 'T':
+			if (nroutes == JACK_MIDI_THRU_MAX)
+				errx (EX_USAGE, "too many routes.");
+			routes[nroutes++] = optarg;
+			break;
+		case 't':
+			thru_only = 1;
+			break;
+		case 'X':
+			if (ntransforms == JACK_MIDI_XFORM_MAX)
+				errx (EX_USAGE, "too many transforms.");
+			transforms[ntransforms++] = optarg;
+			break;
+		case 'L':
+			l = strtol (optarg, &endptr, 0);
+			if (l <= 0 || l > 1000000 || *endptr)
+				usage ("Bad probe count.");
+			probe_count = (int) l;
+			break;
 		case 'h':
 			usage (NULL);
 			break;
@@ -447,9 +2110,50 @@ main (int argc, char **argv)
 		}
 	}
 
-	if ((read_name == NULL && write_name == NULL) ||
-		(dump_file != NULL && read_name == NULL))
+	has_capture = replay_path != NULL;
+	for (i = 0, n = 0; i < ndevs; i++) {
+		if (devs[i].read_name != NULL) {
+			has_capture = 1;
+			/* capture devices are spread over the shards */
+			devs[i].shard = n++ % nshards;
+		}
+	}
+	if (nshards > 1 && dump_file != NULL)
+		usage ("A dump needs a single reader thread.");
+	for (i = 0; i < nroutes; i++)
+		jack_midi_route (routes[i]);
+	for (i = 0; i < ntransforms; i++)
+		jack_midi_transform (transforms[i]);
+	for (i = 0; i < ndevs; i++) {
+		/* one ring per reader thread, each one being a producer */
+		for (c = 0; c < ndevs && ! (devs[c].thru & 1ULL << i); c++)
+			;
+		for (n = 0; c < ndevs && n < nshards; n++) {
+			devs[i].thru_rb[n] =
+				jack_ringbuffer_create (JACK_MIDI_THRU_SIZE);
+			if (devs[i].thru_rb[n] == NULL)
+				errx (EX_OSERR, "Out of memory.");
+			jack_ringbuffer_mlock (devs[i].thru_rb[n]);
+		}
+	}
+	if ((ndevs == 0 && replay_path == NULL) ||
+				(dump_file != NULL && ! has_capture))
 		usage ("Missing device path.");
+	if (replay_path)
+		jack_midi_replay_open ();
+	if (probe_count > 0) {
+		for (i = 0; i < ndevs && probe_dev == NULL; i++) {
+			if (devs[i].read_name && devs[i].write_name)
+				probe_dev = &devs[i];
+		}
+		if (probe_dev == NULL)
+			usage ("Loopback test needs a capture and playback "
+				"device.");
+		probe_time = calloc (probe_count, sizeof (jack_time_t));
+		probe_rtt = calloc (probe_count, sizeof (uint32_t));
+		if (probe_time == NULL || probe_rtt == NULL)
+			errx (EX_OSERR, "Out of memory.");
+	}
 
 	if (background) {
 		if (daemon (0, 0))
@@ -468,10 +2172,36 @@ main (int argc, char **argv)
 		flags += MIDIR_EXPAND;
 	if (dump_hex)
 		flags += MIDIR_DUMPHEX;
-	midi_reader_init (&reader, flags, skipped ? to_skip : NULL);
+	if (dump_log)
+		flags += MIDIR_DUMPLOG;
+	if (dump_file)
+		flags += MIDIR_DUMPASYNC;
+	for (c = 0; c < nshards; c++) {
+		midi_reader_t *reader = &shards[c].reader;
+
+		/* sized by the capture devices of the shard */
+		for (i = n = 0; i < ndevs; i++) {
+			if (devs[i].read_name != NULL && devs[i].shard == c)
+				n++;
+		}
+		if (n == 0)
+			n = 1;
+		if ( ! midi_reader_init_sized (reader, flags, NULL, n,
+						jack_midi_queue_size (n), 0))
+			errx (EX_OSERR, "Out of memory.");
+		for (i = 0; i < nfilters; i++)
+			jack_midi_filter (reader, filters[i], filters_cc[i]);
+		midi_reader_set_clock (reader, jack_midi_clock, NULL);
+		if (nroutes > 0)
+			midi_reader_set_callback (reader, jack_midi_thru,
+							&shards[c]);
+		midi_reader_set_budget (reader, 0);
+		pthread_mutex_init (&shards[c].mtx, NULL);
+	}
 	if (dump_file) {
 		int dfd;
 
+		dump = true;
 		if (dump_file[0] >= '0' && dump_file[0] <= '9') {
 			l = strtol (dump_file, &endptr, 0);
 			if (l < 0 || l > 255 || (endptr && *endptr))
@@ -487,22 +2217,55 @@ main (int argc, char **argv)
 			}
 		}
 		free (dump_file);
-		midi_reader_set_dump_fd (&reader, dfd);
+		/* only one shard, see -j */
+		midi_reader_set_dump_fd (&shards[0].reader, dfd);
 	}
 
 	pthread_mutex_init (&jack_midi_mtx, NULL);
 	jack_error_callback = jack_midi_log_callback;
 	jack_info_callback = jack_midi_log_callback;
 
+	/* event queues */
+	if ( ! evq_init (&main_evq) || ! evq_init (&writer_evq))
+		errx (EX_OSERR, "Could not create event queues.");
+	for (i = 0; i < nshards; i++) {
+		if ( ! evq_init (&shards[i].evq))
+			errx (EX_OSERR, "Could not create event queues.");
+	}
+	jack_midi_watch_devs ();
+	start_time = time (NULL);
+	if (stats_path)
+		jack_midi_stats_open ();
+
+	/* keep the memory of the I/O threads, and their stacks, resident */
+	if (lock_memory && mlockall (MCL_CURRENT | MCL_FUTURE) != 0)
+		warn ("Could not lock memory");
+
+	/* reader threads, one CPU each, and writer thread */
+	for (i = 0; i < nshards; i++) {
+		if (pthread_create (&shards[i].thread, NULL,
+				jack_midi_reader_thread, &shards[i]) != 0)
+			errx (EX_OSERR, "Could not create reader thread.");
+		jack_midi_rt_thread (shards[i].thread, "reader", i);
+	}
+	if (pthread_create (&writer_thread, NULL, jack_midi_writer_thread,
+								NULL) != 0)
+		errx (EX_OSERR, "Could not create writer thread.");
+	jack_midi_rt_thread (writer_thread, "writer", -1);
+	if (replay_path && pthread_create (&replay_thread, NULL,
+					jack_midi_replay_thread, NULL) != 0)
+		errx (EX_OSERR, "Could not create replay thread.");
+
 	/* loop */
 	while (1) {
 		/* check status of MIDI device */
-		jack_midi_openclose ();
+		timeout = jack_midi_openclose (changed);
+		changed = false;
 
 		/* create jack client if needed */
 		jack_midi_create_client (background);
-		if (jack_client == NULL) {
-			if (dump_file == NULL) {
+		if (jack_client == NULL && ! jack_lost) {
+			if ( ! dump) {
 				errx (EX_UNAVAILABLE,
 				"Unable to create Jack client and no dump file "
 				"file requested, stopping now. Check that a "
@@ -516,13 +2279,43 @@ main (int argc, char **argv)
 			}
 		}
 
-		/* read frame */
-		midi_reader_update (&reader);
-		if (jack_client == NULL)
-			midi_reader_clear_queue (&reader);
+		/* the tick retries Jack, writes the dump and ends a replay;
+		 * without directory watch, it also checks playback devices
+		 */
+		n = (jack_client == NULL || dump || replay_path != NULL ||
+			! dev_watch) ? JACK_MIDI_HOTPLUG_MS : 0;
+		if (n != tick && evq_set_timer (&main_evq, n))
+			tick = n;
+
+		/* wait for a device, the tick, a wakeup or a stats client */
+		n = evq_wait (&main_evq, ev, 4, timeout);
+		if (n < 0)
+			usleep (JACK_MIDI_HOTPLUG_MS * 1000);
+		for (i = 0; i < n; i++) {
+			if (ev[i].type & EVQ_CHANGE)
+				changed = true;
+			else if (stats_fd > -1 && ev[i].fd == stats_fd)
+				jack_midi_stats_serve ();
+		}
+		midi_reader_flush_dump (&shards[0].reader);
+		if (ndevs == 0 && __atomic_load_n (&replay_done,
+							__ATOMIC_ACQUIRE)) {
+			uint32_t used;
 
-		/* wait a bit */
-		usleep (500);
+			/* replay only: stop once Jack got all the frames */
+			midi_reader_get_queue_usage (&shards[0].reader, &used,
+									NULL);
+			if (used == 0)
+				jack_midi_jack_shutdown (NULL);
+		}
+		if (jack_shutdown) {
+			jack_shutdown = 0;
+			jack_midi_close_client ();
+		}
+		if (__atomic_load_n (&probe_done, __ATOMIC_ACQUIRE)) {
+			jack_midi_probe_report ();
+			jack_midi_jack_shutdown (NULL);
+		}
 	}
 
 	/* not reached */
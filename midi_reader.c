@@ -25,6 +25,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
@@ -46,7 +47,7 @@ midi_reader_poll_src (midi_reader_t *reader, int *src)
 	if (reader == NULL || reader->nsources == 0)
 		return (-1);
 	else {
-		struct pollfd pfd[MIDI_READER_IN_MAX];
+		struct pollfd pfd[reader->nsources];
 		int r, i;
 
 		for (i = 0; i < reader->nsources; i++) {
@@ -73,39 +74,136 @@ midi_reader_poll (midi_reader_t *reader)
 	return (midi_reader_poll_src (reader, &src));
 }
 
+/* Reset a source, keeping its cold part. */
 static void
 midi_reader_reset_source (midi_reader_source_t *src, bool to_close)
 {
 	if (src) {
+		midi_reader_source_cold_t *cold = src->cold;
+		int fd = src->fd;
+
+		free (cold->sysex);
+		free (cold->transform);
+		memset (cold, 0, sizeof (midi_reader_source_cold_t));
 		memset (src, 0, sizeof (midi_reader_source_t));
-		if (to_close) {
-			close (src->fd);
-			src->fd = -1;
-		}
-		src->push_back = -1;
-		src->channel = -1;
+		if (to_close && fd > -1)
+			close (fd);
+		src->fd = -1;
+		src->cold = cold;
 	}
 }
 
 static void
 midi_reader_reset_source_n (midi_reader_t *reader, int src, bool to_close)
 {
-	if (src >= 0 && src < MIDI_READER_IN_MAX)
+	if (src >= 0 && src < reader->max_sources)
 		midi_reader_reset_source (&reader->sources[src], to_close);
 }
 
-void
+/* Round 'n' up to a power of 2, at least 1024 (0: 'def'). */
+static uint32_t
+midi_reader_pow2 (uint32_t n, uint32_t def)
+{
+	uint32_t p = 1024;
+
+	if (n == 0)
+		n = def;
+	while (p < n && p < (1U << 30))
+		p <<= 1;
+	return (p);
+}
+
+bool
 midi_reader_init (midi_reader_t *reader, midi_reader_flags_t flags,
 			const unsigned char *to_skip)
 {
-	if (reader) {
-		memset (reader, 0, sizeof (midi_reader_t));
-		reader->flags = flags;
-		for (int i = 0; i < MIDI_READER_IN_MAX; i++)
-			midi_reader_reset_source_n (reader, i, false);
-		reader->dumpfd = -1;
-		reader->to_skip = to_skip;
+	return (midi_reader_init_sized (reader, flags, to_skip, 0, 0, 0));
+}
+
+bool
+midi_reader_init_sized (midi_reader_t *reader, midi_reader_flags_t flags,
+			const unsigned char *to_skip, int max_sources,
+			uint32_t queue_size, uint32_t dump_size)
+{
+	void *p;
+
+	if (reader == NULL || max_sources < 0 || max_sources > 0xffff)
+		return (false);
+	memset (reader, 0, sizeof (midi_reader_t));
+	reader->dumpfd = -1;
+	reader->max_sources = max_sources ? max_sources : MIDI_READER_IN_MAX;
+	reader->frames.size = midi_reader_pow2 (queue_size,
+						MIDI_READER_QUEUE_SIZE);
+	reader->dump.size = midi_reader_pow2 (dump_size, MIDI_READER_DUMP_SIZE);
+
+	/* parser states on their own cache lines, then the cold parts */
+	if (posix_memalign (&p, 64, reader->max_sources *
+				sizeof (midi_reader_source_t)) != 0)
+		goto fail;
+	reader->sources = p;
+	if (posix_memalign (&p, 64, reader->frames.size) != 0)
+		goto fail;
+	reader->frames.queue = p;
+	reader->cold = calloc (reader->max_sources,
+				sizeof (midi_reader_source_cold_t));
+	if (reader->cold == NULL)
+		goto fail;
+	for (int i = 0; i < reader->max_sources; i++) {
+		reader->sources[i].cold = &reader->cold[i];
+		midi_reader_reset_source_n (reader, i, false);
 	}
+
+	reader->flags = flags;
+	for (; to_skip && *to_skip; to_skip++)
+		midi_reader_filter_status (reader, *to_skip, *to_skip);
+	reader->start = -1;
+	reader->budget = 1;
+	return (true);
+
+fail:
+	midi_reader_destroy (reader);
+	return (false);
+}
+
+#define MIDI_BIT_SET(map, n)	((map)[(n) >> 5] |= 1U << ((n) & 31))
+#define MIDI_BIT_ISSET(map, n)	(((map)[(n) >> 5] >> ((n) & 31)) & 1)
+
+bool
+midi_reader_filter_status (midi_reader_t *reader, int lo, int hi)
+{
+	if (reader == NULL || lo < 0x80 || hi > 0xff || lo > hi)
+		return (false);
+	for (int b = lo; b <= hi; b++)
+		MIDI_BIT_SET (reader->skip, b);
+	return (true);
+}
+
+bool
+midi_reader_filter_channel (midi_reader_t *reader, int channel)
+{
+	if (reader == NULL || channel < 1 || channel > 16)
+		return (false);
+	for (int b = 0x80; b < 0xf0; b += 0x10)
+		MIDI_BIT_SET (reader->skip, b + channel - 1);
+	return (true);
+}
+
+bool
+midi_reader_filter_cc (midi_reader_t *reader, int channel, int lo, int hi)
+{
+	int c;
+
+	if (reader == NULL || channel < 0 || channel > 16 ||
+					lo < 0 || hi > 127 || lo > hi)
+		return (false);
+	for (c = 0; c < 16; c++) {
+		if (channel != 0 && c != channel - 1)
+			continue;
+		for (int n = lo; n <= hi; n++)
+			MIDI_BIT_SET (reader->skip_cc[c], n);
+	}
+	reader->has_skip_cc = true;
+	return (true);
 }
 
 bool
@@ -125,25 +223,157 @@ midi_reader_add_source_path (midi_reader_t *reader,
 	return (false);
 }
 
+/* Set or reset the transform of a source. */
+static bool
+midi_reader_source_transform (midi_reader_t *reader,
+		midi_reader_source_t *src, const midi_reader_transform_t *xf)
+{
+	midi_reader_source_cold_t *cold = src->cold;
+
+	if (xf == NULL) {
+		free (cold->transform);
+		cold->transform = NULL;
+	}
+	else {
+		if (cold->transform == NULL)
+			cold->transform = malloc (sizeof (*xf));
+		if (cold->transform == NULL)
+			return (false);
+		memcpy (cold->transform, xf, sizeof (*xf));
+	}
+	/* a split changes the channel of some messages only */
+	src->expand = (reader->flags & MIDIR_EXPAND) || (xf && xf->split);
+	return (true);
+}
+
 bool
 midi_reader_add_source (midi_reader_t *reader, int fd, int channel)
 {
-	if (reader && fd > -1 && reader->nsources < MIDI_READER_IN_MAX) {
+	midi_reader_transform_t xf;
+	midi_reader_source_t *src;
+
+	if (reader && fd > -1 && reader->nsources < reader->max_sources) {
 		for (int i = 0; i < reader->nsources; i++) {
 			if (reader->sources[i].fd == fd)
 				return (true);
 		}
-		reader->sources[reader->nsources].fd = fd;
-		if (channel >= 1 && channel <= 16)
-			reader->sources[reader->nsources].channel = channel;
-		else
-			reader->sources[reader->nsources].channel = -1;
+		src = &reader->sources[reader->nsources];
+		midi_reader_transform_init (&xf);
+		if ( ! midi_reader_transform_channel (&xf, 0, channel))
+			midi_reader_source_transform (reader, src, NULL);
+		else if ( ! midi_reader_source_transform (reader, src, &xf))
+			return (false);
+		src->fd = fd;
+		src->id = reader->nsources;
 		reader->nsources++;
 		return (true);
 	}
 	return (false);
 }
 
+bool
+midi_reader_set_transform (midi_reader_t *reader, int fd,
+				const midi_reader_transform_t *xf)
+{
+	if (reader == NULL || fd < 0)
+		return (false);
+	for (int i = 0; i < reader->nsources; i++) {
+		if (reader->sources[i].fd == fd)
+			return (midi_reader_source_transform (reader,
+						&reader->sources[i], xf));
+	}
+	return (false);
+}
+
+void
+midi_reader_transform_init (midi_reader_transform_t *xf)
+{
+	for (int i = 0; i < 16; i++)
+		xf->channel[i] = i;
+	for (int i = 0; i < 128; i++) {
+		xf->note[i] = i;
+		xf->note_channel[i] = 0xff;
+		xf->velocity[i] = i;
+		xf->cc[i] = i;
+	}
+	xf->split = false;
+}
+
+bool
+midi_reader_transform_channel (midi_reader_transform_t *xf, int from, int to)
+{
+	if (xf == NULL || from < 0 || from > 16 || to < 1 || to > 16)
+		return (false);
+	for (int i = 0; i < 16; i++) {
+		if (from == 0 || i == from - 1)
+			xf->channel[i] = to - 1;
+	}
+	return (true);
+}
+
+bool
+midi_reader_transform_velocity (midi_reader_transform_t *xf, int lo, int hi)
+{
+	if (xf == NULL || lo < 1 || hi > 127 || lo > hi)
+		return (false);
+	/* 0 is a note-off, kept */
+	for (int i = 1; i < 128; i++)
+		xf->velocity[i] = lo + ((i - 1) * (hi - lo) + 63) / 126;
+	return (true);
+}
+
+bool
+midi_reader_transform_transpose (midi_reader_transform_t *xf, int semitones)
+{
+	int n;
+
+	if (xf == NULL || semitones < -127 || semitones > 127)
+		return (false);
+	for (int i = 0; i < 128; i++) {
+		if (xf->note[i] == 0xff)
+			continue;
+		n = xf->note[i] + semitones;
+		xf->note[i] = n >= 0 && n < 128 ? n : 0xff;
+	}
+	return (true);
+}
+
+bool
+midi_reader_transform_split (midi_reader_transform_t *xf, int lo, int hi,
+				int channel)
+{
+	if (xf == NULL || lo < 0 || hi > 127 || lo > hi || channel < 1 ||
+							channel > 16)
+		return (false);
+	for (int i = lo; i <= hi; i++)
+		xf->note_channel[i] = channel - 1;
+	xf->split = true;
+	return (true);
+}
+
+bool
+midi_reader_transform_cc (midi_reader_transform_t *xf, int from, int to)
+{
+	if (xf == NULL || from < 0 || from > 127 || to < 0 || to > 127)
+		return (false);
+	xf->cc[from] = to;
+	return (true);
+}
+
+bool
+midi_reader_set_source_id (midi_reader_t *reader, int fd, uint16_t id)
+{
+	if (reader == NULL || fd < 0)
+		return (false);
+	for (int i = 0; i < reader->nsources; i++) {
+		if (reader->sources[i].fd == fd) {
+			reader->sources[i].id = id;
+			return (true);
+		}
+	}
+	return (false);
+}
+
 bool
 midi_reader_remove_source (midi_reader_t *reader, int fd)
 {
@@ -159,10 +389,15 @@ midi_reader_remove_source (midi_reader_t *reader, int fd)
 	if (i >= reader->nsources)
 		return (false);
 	else {
+		midi_reader_source_cold_t *cold = reader->sources[i].cold;
+
 		midi_reader_reset_source_n (reader, i, true);
-		for (j = i + 1; j < MIDI_READER_IN_MAX; j++)
+		for (j = i + 1; j < reader->nsources; j++)
 			reader->sources[j - 1] = reader->sources[j];
-		midi_reader_reset_source_n (reader, j, false);
+		/* the last slot was moved, give it the free cold part and
+		 * clear its parser state */
+		reader->sources[j - 1].cold = cold;
+		midi_reader_reset_source_n (reader, j - 1, false);
 		reader->nsources--;
 		return (true);
 	}
@@ -172,6 +407,11 @@ bool
 midi_reader_set_dump_fd (midi_reader_t *reader, int fd)
 {
 	if (reader && fd > -1) {
+		if (reader->dump.buf == NULL) {
+			reader->dump.buf = malloc (reader->dump.size);
+			if (reader->dump.buf == NULL)
+				return (false);
+		}
 		reader->dumpfd = fd;
 		return (true);
 	}
@@ -209,6 +449,25 @@ midi_reader_set_callback (midi_reader_t *reader,
 	}
 }
 
+void
+midi_reader_set_clock (midi_reader_t *reader,
+			midi_reader_clock_t clock, void *user_data)
+{
+	if (reader) {
+		reader->clock = clock;
+		reader->clock_data = user_data;
+	}
+}
+
+static uint64_t
+midi_reader_time (midi_reader_t *reader)
+{
+	if (reader->clock)
+		return (reader->clock (reader->clock_data));
+	else
+		return (0);
+}
+
 static void
 midi_reader_read (midi_reader_t *reader)
 {
@@ -217,36 +476,29 @@ midi_reader_read (midi_reader_t *reader)
 
 	for (int i = 0; i < reader->nsources; i++) {
 		s = &reader->sources[i];
-		if (s->push_back > -1)
-			continue;
 		if (s->buf_offset >= s->buf_len) {
 			s->buf_len = 0;
 			s->buf_offset = 0;
 		}
 		if (s->buf_len >= MIDI_READER_BUF_MAX)
 			continue;
-		r = read (s->fd, s->buf + s->buf_len,
+		r = read (s->fd, s->cold->buf + s->buf_len,
 				MIDI_READER_BUF_MAX - s->buf_len);
-		if (r > 0)
+		if (r > 0) {
 			s->buf_len += r;
+			s->time = midi_reader_time (reader);
+		}
 	}
 }
 
 static int
 midi_reader_get_byte (midi_reader_t *reader, int src)
 {
-	int r;
 	midi_reader_source_t *s = &reader->sources[src];
 
-	if (s->push_back > -1) {
-		/* requested source has a push-backed byte */
-		r = s->push_back;
-		s->push_back = -1;
-		return (r);
-	}
-	else if (s->buf_len > 0 && s->buf_offset < s->buf_len) {
+	if (s->buf_offset < s->buf_len) {
 		/* requested source has a buffered byte */
-		return (s->buf[s->buf_offset++]);
+		return (s->cold->buf[s->buf_offset++]);
 	}
 	else
 		return (-1);
@@ -256,11 +508,330 @@ void
 midi_frame_reset (midi_frame_t *mf)
 {
 	if (mf) {
+		mf->time = 0;
+		mf->source = MIDI_SOURCE_NONE;
 		mf->len = 0;
 		mf->data[0] = 0;
 	}
 }
 
+static inline midi_qframe_t*
+midi_reader_qframe_at (midi_frames_t *q, uint32_t pos)
+{
+	return ((midi_qframe_t*) ((unsigned char*) q->queue +
+				(pos & (q->size - 1))));
+}
+
+/* Get room at the head of the queue for a frame of 'len' bytes, or NULL
+ * if the queue is full. Producer side.
+ */
+static midi_qframe_t*
+midi_reader_reserve (midi_reader_t *reader, uint32_t len)
+{
+	midi_frames_t *q = &reader->frames;
+	uint32_t head = q->head;
+	uint32_t tail = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+	uint32_t size = MIDI_QFRAME_SIZE (len);
+	uint32_t end = q->size - (head & (q->size - 1));
+
+	if (size > end) {
+		/* frame must be contiguous: skip end of the queue */
+		if (q->size - (head - tail) < end + size)
+			return (NULL);
+		if (end >= sizeof (midi_qframe_t))
+			midi_reader_qframe_at (q, head)->len = MIDI_QFRAME_WRAP;
+		__atomic_store_n (&q->head, head + end, __ATOMIC_RELEASE);
+		head += end;
+	}
+	else if (q->size - (head - tail) < size)
+		return (NULL);
+	return (midi_reader_qframe_at (q, head));
+}
+
+/* Make the frame returned by "midi_reader_reserve" available. */
+static void
+midi_reader_produce (midi_reader_t *reader, midi_qframe_t *qf)
+{
+	midi_frames_t *q = &reader->frames;
+	uint32_t head = q->head + MIDI_QFRAME_SIZE (qf->len);
+
+	__atomic_store_n (&q->head, head, __ATOMIC_RELEASE);
+	head -= __atomic_load_n (&q->tail, __ATOMIC_RELAXED);
+	if (head > q->high)
+		__atomic_store_n (&q->high, head, __ATOMIC_RELAXED);
+}
+
+static void
+midi_bytes_dump (const unsigned char *data, uint32_t len, int fd)
+{
+	for (uint32_t j = 0; j < len; j++)
+		dprintf (fd, "%.2x ", data[j]);
+}
+
+/* Queue a frame in the dump buffer, after 'hlen' bytes of header, or
+ * nothing if there is not enough room.
+ */
+static bool
+midi_reader_dump_put (midi_reader_t *reader, const unsigned char *hdr,
+			uint32_t hlen, const unsigned char *data, uint32_t len)
+{
+	midi_dump_t *d = &reader->dump;
+	uint32_t head = d->head;
+	uint32_t tail = __atomic_load_n (&d->tail, __ATOMIC_ACQUIRE);
+	const unsigned char *src[2] = { hdr, data };
+	uint32_t slen[2] = { hlen, len };
+	uint32_t off, n;
+
+	if (d->size - (head - tail) < hlen + len)
+		return (false);
+	for (int i = 0; i < 2; i++) {
+		if (slen[i] == 0)
+			continue;
+		off = (head & (d->size - 1));
+		n = d->size - off;
+		if (n > slen[i])
+			n = slen[i];
+		memcpy (d->buf + off, src[i], n);
+		memcpy (d->buf, src[i] + n, slen[i] - n);
+		head += slen[i];
+	}
+	__atomic_store_n (&d->head, head, __ATOMIC_RELEASE);
+	return (true);
+}
+
+/* Encode an unsigned LEB128 varint. Return its length. */
+static int
+midi_varint_put (unsigned char *p, uint64_t v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return (n);
+}
+
+/* Decode an unsigned LEB128 varint of at most 'len' bytes. Return its
+ * length, or 0 if it is truncated or too long.
+ */
+static int
+midi_varint_get (const unsigned char *p, size_t len, uint64_t *v)
+{
+	int n;
+
+	*v = 0;
+	for (n = 0; n < (int) len && n < 10; n++) {
+		*v |= (uint64_t) (p[n] & 0x7f) << (7 * n);
+		if ( ! (p[n] & 0x80))
+			return (n + 1);
+	}
+	return (0);
+}
+
+/* Queue a frame in the dump buffer in log format, preceded with the log
+ * header for the first one.
+ */
+static bool
+midi_reader_log_put (midi_reader_t *reader, midi_reader_source_t *src,
+			uint64_t time, const unsigned char *data, uint32_t len)
+{
+	unsigned char hdr[32];
+	int64_t dt;
+	int n = 0;
+
+	if ( ! reader->log_started) {
+		memcpy (hdr, MIDI_LOG_MAGIC, 8);
+		for (n = 0; n < 8; n++)
+			hdr[8 + n] = (time >> (8 * n)) & 0xff;
+		if ( ! midi_reader_dump_put (reader, hdr, MIDI_LOG_HEADER,
+								NULL, 0))
+			return (false);
+		reader->log_started = true;
+		reader->log_time = time;
+	}
+	/* frames of several sources are not always in time order */
+	dt = (int64_t) (time - reader->log_time);
+	n = midi_varint_put (hdr, ((uint64_t) dt << 1) ^ (uint64_t) (dt >> 63));
+	n += midi_varint_put (hdr + n, src->id);
+	n += midi_varint_put (hdr + n, len);
+	if ( ! midi_reader_dump_put (reader, hdr, n, data, len))
+		return (false);
+	reader->log_time = time;
+	return (true);
+}
+
+/* Write 'len' bytes, retrying after partial writes. */
+static bool
+midi_reader_write_all (int fd, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write (fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return (false);
+		buf += r;
+		len -= r;
+	}
+	return (true);
+}
+
+uint32_t
+midi_reader_ump_words (const unsigned char *data, uint32_t len,
+			uint32_t *words, uint32_t max)
+{
+	unsigned char b[6];
+	uint32_t i, k, n, m, st;
+
+	if (len == 0 || data[0] < 0x80)
+		return (0);
+	if (data[0] == 0xf0) {
+		/* 6 data bytes per packet, without F0 and F7 */
+		data++;
+		len--;
+		if (len > 0 && data[len - 1] == 0xf7)
+			len--;
+		n = len > 0 ? (len + 5) / 6 : 1;
+		if (words == NULL || max < 2 * n)
+			return (2 * n);
+		for (k = 0; k < n; k++, data += 6, len -= m) {
+			m = len < 6 ? len : 6;
+			memset (b, 0, sizeof (b));
+			memcpy (b, data, m);
+			/* complete, start, continue or end packet */
+			st = n == 1 ? 0 : k == 0 ? 1 : k == n - 1 ? 3 : 2;
+			words[2 * k] = 0x30000000U | st << 20 | m << 16 |
+				(uint32_t) b[0] << 8 | b[1];
+			words[2 * k + 1] = (uint32_t) b[2] << 24 |
+				(uint32_t) b[3] << 16 | (uint32_t) b[4] << 8 | b[5];
+		}
+		return (2 * n);
+	}
+	if (data[0] >= 0xf0) {
+		/* system common or real-time */
+		if (words != NULL && max >= 1) {
+			words[0] = 0x10000000U | (uint32_t) data[0] << 16 |
+				(uint32_t) (len > 1 ? data[1] : 0) << 8 |
+				(len > 2 ? data[2] : 0);
+		}
+		return (1);
+	}
+	/* channel voice, a word per message of a running status frame */
+	m = midi_frame_len[data[0] - 0x80] - 1;
+	n = (len - 1) / m;
+	if (words == NULL || max < n)
+		return (n);
+	for (k = 0, i = 1; k < n; k++, i += m) {
+		words[k] = 0x20000000U | (uint32_t) data[0] << 16 |
+			(uint32_t) data[i] << 8 | (m == 2 ? data[i + 1] : 0);
+	}
+	return (n);
+}
+
+int
+midi_reader_ump_bytes (const uint32_t *words, uint32_t n,
+			unsigned char *data, int max)
+{
+	unsigned char b[6];
+	uint32_t i, w, st;
+	int len = 0, m;
+
+	for (i = 0; i < n; i++) {
+		w = words[i];
+		switch (w >> 28) {
+		case 1:
+		case 2:
+			st = (w >> 16) & 0xff;
+			if (st < 0x80 || st == 0xf0 || st == 0xf7 ||
+					(st >= 0xf0) != (w >> 28 == 1))
+				return (-1);
+			m = midi_frame_len[st - 0x80];
+			if (len + m > max)
+				return (-1);
+			data[len++] = st;
+			if (m > 1)
+				data[len++] = (w >> 8) & 0x7f;
+			if (m > 2)
+				data[len++] = w & 0x7f;
+			break;
+		case 3:
+			st = (w >> 20) & 0x0f;
+			m = (w >> 16) & 0x0f;
+			if (i + 1 == n || st > 3 || m > 6 || len + m +
+					(st == 0 || st == 1) +
+					(st == 0 || st == 3) > max)
+				return (-1);
+			b[0] = w >> 8;
+			b[1] = w;
+			w = words[++i];
+			b[2] = w >> 24;
+			b[3] = w >> 16;
+			b[4] = w >> 8;
+			b[5] = w;
+			if (st == 0 || st == 1)
+				data[len++] = 0xf0;
+			for (int j = 0; j < m; j++)
+				data[len++] = b[j] & 0x7f;
+			if (st == 0 || st == 3)
+				data[len++] = 0xf7;
+			break;
+		default:
+			return (-1);
+		}
+	}
+	return (len);
+}
+
+/* Dump and store a validated frame, tagged with its source. */
+static void
+midi_reader_store (midi_reader_t *reader, midi_reader_source_t *src,
+			uint64_t time, const unsigned char *data, uint32_t len)
+{
+	midi_qframe_t *qf;
+	uint32_t words = 0;
+	bool ok;
+
+	/* dump, written later */
+	if (reader->dumpfd > -1) {
+		if (reader->flags & MIDIR_DUMPLOG)
+			ok = midi_reader_log_put (reader, src, time, data, len);
+		else
+			ok = midi_reader_dump_put (reader, NULL, 0, data, len);
+		if ( ! ok) {
+			src->cold->stats.dump_lost++;
+			reader->total.dump_lost++;
+		}
+	}
+
+	/* store, as UMP words if asked for */
+	if (reader->flags & MIDIR_UMP)
+		words = midi_reader_ump_words (data, len, NULL, 0);
+	qf = midi_reader_reserve (reader, words ? 4 * words : len);
+	if (qf) {
+		qf->time = time;
+		qf->source = src->id;
+		qf->words = words;
+		if (words) {
+			qf->len = 4 * words;
+			midi_reader_ump_words (data, len, (uint32_t *) qf->data,
+						words);
+		}
+		else {
+			qf->len = len;
+			memcpy (qf->data, data, len);
+		}
+		midi_reader_produce (reader, qf);
+	}
+	else {
+		src->cold->stats.missed++;
+		reader->total.missed++;
+	}
+}
+
 static midi_frame_state_t
 midi_reader_push_frame (midi_reader_t *reader, midi_frame_t *mf,
 			midi_reader_source_t *src)
@@ -273,59 +844,101 @@ midi_reader_push_frame (midi_reader_t *reader, midi_frame_t *mf,
 		if (mf->len == 0)
 			return (MIDIF_NODATA);
 		else if (st == MIDIF_SKIPPED) {
-			src->stats.skipped++;
+			src->cold->stats.skipped++;
 			reader->total.skipped++;
 			return (MIDIF_SKIPPED);
 		}
 		else if (st != MIDIF_COMPLETE) {
-			src->stats.errors++;
+			src->cold->stats.errors++;
 			reader->total.errors++;
 			return (st);
 		}
 	}
 
-	/* dump */
-	if (reader->dumpfd > -1) {
-		if (reader->flags & MIDIR_DUMPHEX)
-			midi_frame_dump (mf, reader->dumpfd);
-		else
-			write (reader->dumpfd, (char*) mf->data, mf->len);
-	}
+	midi_reader_store (reader, src, mf->time, mf->data, mf->len);
+	return (MIDIF_COMPLETE);
+}
 
-	/* store */
-	if (reader->frames.len == reader->frames.offset) {
-		reader->frames.len = 0;
-		reader->frames.offset = 0;
-	}
-	if (reader->frames.len < MIDI_READER_FRAMES_MAX) {
-		memcpy (&reader->frames.frames[reader->frames.len++],
-			mf, sizeof (midi_frame_t));
+/* Return true if frames with given status byte must be skipped. */
+static inline bool
+midi_reader_skip (midi_reader_t *reader, unsigned char status)
+{
+	return (MIDI_BIT_ISSET (reader->skip, status));
+}
+
+/* Remove the filtered-out controllers of a control change frame, which
+ * may use running status. Return true if nothing is left.
+ */
+static bool
+midi_reader_skip_cc (midi_reader_t *reader, midi_frame_t *mf)
+{
+	const uint32_t *map = reader->skip_cc[mf->data[0] & 0x0f];
+	int i, n;
+
+	for (i = n = 1; i + 1 < mf->len; i += 2) {
+		if (MIDI_BIT_ISSET (map, mf->data[i] & 0x7f))
+			continue;
+		mf->data[n++] = mf->data[i];
+		mf->data[n++] = mf->data[i + 1];
 	}
-	else
-		reader->total.missed++;
+	mf->len = n;
+	return (n == 1);
+}
 
-	return (MIDIF_COMPLETE);
+/* Transform in place a channel message frame, which may use running
+ * status, if the frames are not expanded. Return true if nothing is left.
+ */
+static bool
+midi_reader_transform (const midi_reader_transform_t *xf, midi_frame_t *mf)
+{
+	unsigned char type = mf->data[0] & 0xf0;
+	unsigned char ch = xf->channel[mf->data[0] & 0x0f];
+	int i, n;
+
+	if (mf->data[0] < 0x80 || mf->data[0] > 0xef)
+		return (false);
+	switch (type) {
+	case 0x80:
+	case 0x90:
+	case 0xa0:
+		for (i = n = 1; i + 1 < mf->len; i += 2) {
+			unsigned char note = mf->data[i];
+
+			if (xf->note[note] == 0xff)
+				continue;
+			/* single message when split */
+			if (xf->note_channel[note] != 0xff)
+				ch = xf->note_channel[note];
+			mf->data[n++] = xf->note[note];
+			mf->data[n++] = type == 0x90 ?
+				xf->velocity[mf->data[i + 1]] : mf->data[i + 1];
+		}
+		mf->len = n;
+		break;
+	case 0xb0:
+		for (i = 1; i + 1 < mf->len; i += 2)
+			mf->data[i] = xf->cc[mf->data[i]];
+		break;
+	default:
+		break;
+	}
+	mf->data[0] = type | ch;
+	return (mf->len == 1);
 }
 
 static midi_frame_state_t
 midi_frame_process (midi_reader_t *reader, midi_frame_t *mf,
 			midi_reader_source_t *src)
 {
-	bool skipped = false;
-	const unsigned char *p;
+	bool skipped;
 
 	if (mf->len == 0)
 		return (MIDIF_NODATA);
-	src->stats.read++;
+	src->cold->stats.read++;
 	reader->total.read++;
-	if (reader->to_skip) {
-		for (p = reader->to_skip; *p; p++) {
-			if (mf->data[0] == *p) {
-				skipped = true;
-				break;
-			}
-		}
-	}
+	skipped = midi_reader_skip (reader, mf->data[0]);
+	if ( ! skipped && reader->has_skip_cc && (mf->data[0] & 0xf0) == 0xb0)
+		skipped = midi_reader_skip_cc (reader, mf);
 	if (reader->flags & MIDIR_DEBUG) {
 		dprintf (2, "incoming frame%s",
 				skipped ? " (skipped): " : ": ");
@@ -333,38 +946,87 @@ midi_frame_process (midi_reader_t *reader, midi_frame_t *mf,
 		dprintf (2, "\n");
 	}
 	if (skipped) {
-		src->stats.skipped++;
+		src->cold->stats.skipped++;
 		reader->total.skipped++;
 		return (MIDIF_SKIPPED);
 	}
 
-	/* channel translation */
-	if (src->channel > 0) {
-		if (mf->data[0] >= 0x80 && mf->data[0] <= 0xef) {
-			mf->data[0] = mf->data[0] & 0xF0;
-			mf->data[0] |= src->channel - 1;
-		}
+	if (src->cold->transform != NULL &&
+			midi_reader_transform (src->cold->transform, mf)) {
+		src->cold->stats.skipped++;
+		reader->total.skipped++;
+		return (MIDIF_SKIPPED);
 	}
 
-	/* running-status expansion ? */
-	if ( ! (reader->flags & MIDIR_EXPAND) ||
-		(mf->data[0] < 0x80 || mf->data[0] > 0xef || mf->len == 3))
-		return (midi_reader_push_frame (reader, mf, src));
-	else if ((mf->len - 1) % 2)
-		return (MIDIF_ERROR);
-	else {
-		int i;
-		midi_frame_t f;
-
-		f.len = 3;
-		for (i = 1; i < mf->len; i += 2) {
-			f.data[0] = mf->data[0];
-			f.data[1] = mf->data[i];
-			f.data[2] = mf->data[i+1];
-			midi_reader_push_frame (reader, &f, src);
-		}
-		return (MIDIF_COMPLETE);
+	return (midi_reader_push_frame (reader, mf, src));
+}
+
+/* Grow the buffer of a long system exclusive frame. */
+static bool
+midi_reader_grow_sysex (midi_reader_source_t *src)
+{
+	uint32_t size = src->cold->sysex_size ? src->cold->sysex_size * 2 :
+						MIDI_FRAME_MAX * 4;
+	unsigned char *p;
+
+	if (size > MIDI_READER_SYSEX_MAX)
+		return (false);
+	p = realloc (src->cold->sysex, size);
+	if (p == NULL)
+		return (false);
+	src->cold->sysex = p;
+	src->cold->sysex_size = size;
+	return (true);
+}
+
+/* Process a complete long system exclusive frame. The user callback is
+ * not invoked since the frame does not fit in a midi_frame_t.
+ */
+static midi_frame_state_t
+midi_reader_process_sysex (midi_reader_t *reader, midi_reader_source_t *src)
+{
+	bool skipped;
+
+	src->cold->stats.read++;
+	reader->total.read++;
+	skipped = midi_reader_skip (reader, src->cold->sysex[0]);
+	if (reader->flags & MIDIR_DEBUG) {
+		dprintf (2, "incoming frame%s",
+				skipped ? " (skipped): " : ": ");
+		midi_bytes_dump (src->cold->sysex, src->cold->sysex_len, 2);
+		dprintf (2, "\n");
+	}
+	if (skipped) {
+		src->cold->stats.skipped++;
+		reader->total.skipped++;
+		return (MIDIF_SKIPPED);
 	}
+	midi_reader_store (reader, src, src->cold->current.time,
+				src->cold->sysex, src->cold->sysex_len);
+	return (MIDIF_COMPLETE);
+}
+
+/* Add a byte to a system exclusive frame longer than MIDI_FRAME_MAX. */
+static midi_frame_state_t
+midi_reader_push_sysex (midi_reader_t *reader, midi_reader_source_t *src,
+			unsigned char b)
+{
+	midi_frame_t *mf = &src->cold->current;
+
+	if (src->cold->sysex_len == 0) {
+		/* current frame is full, continue in the long buffer */
+		if (src->cold->sysex_size < mf->len && ! midi_reader_grow_sysex (src))
+			return (MIDIF_ERROR);
+		memcpy (src->cold->sysex, mf->data, mf->len);
+		src->cold->sysex_len = mf->len;
+	}
+	if (src->cold->sysex_len == src->cold->sysex_size && ! midi_reader_grow_sysex (src))
+		return (MIDIF_ERROR);
+	src->cold->sysex[src->cold->sysex_len++] = b;
+	if (b == 0xf7)
+		return (midi_reader_process_sysex (reader, src));
+	else
+		return (MIDIF_NEXT);
 }
 
 void
@@ -377,108 +1039,312 @@ midi_reader_close (midi_reader_t *reader)
 
 	for (i = 0; i < reader->nsources; i++)
 		midi_reader_reset_source_n (reader, i, true);
+	reader->nsources = 0;
 
 	if (reader->dumpfd > -1) {
+		midi_reader_flush_dump (reader);
 		close (reader->dumpfd);
 		reader->dumpfd = -1;
 	}
 }
 
+void
+midi_reader_destroy (midi_reader_t *reader)
+{
+	if (reader == NULL)
+		return;
+	midi_reader_close (reader);
+	if (reader->dumpfd > -1) {
+		/* not closed above without source */
+		midi_reader_flush_dump (reader);
+		close (reader->dumpfd);
+	}
+	if (reader->cold) {
+		for (int i = 0; i < reader->max_sources; i++) {
+			free (reader->cold[i].sysex);
+			free (reader->cold[i].transform);
+		}
+	}
+	free (reader->cold);
+	free (reader->sources);
+	free (reader->frames.queue);
+	free (reader->dump.buf);
+	memset (reader, 0, sizeof (midi_reader_t));
+	reader->dumpfd = -1;
+}
+
+/* parser states */
+enum {
+	MIDI_S_IDLE = 0, /* no frame in progress */
+	MIDI_S_MSG, /* message waiting for its data bytes */
+	MIDI_S_RUN, /* complete channel messages, running status */
+	MIDI_S_SYSEX, /* system exclusive frame */
+	MIDI_S_MAX
+};
+
+/* parser actions */
+enum {
+	MIDI_A_ERROR = 0, /* unexpected byte, reset the parser */
+	MIDI_A_START, /* status byte starting a frame */
+	MIDI_A_DATA, /* data byte of a message */
+	MIDI_A_RUN, /* data byte of a running status message */
+	MIDI_A_END, /* status byte ending a running status frame */
+	MIDI_A_ABORT, /* status byte interrupting a frame */
+	MIDI_A_RT, /* real-time byte */
+	MIDI_A_SYSEX, /* system exclusive data byte */
+	MIDI_A_EOX /* end of system exclusive */
+};
+
+/* class of each byte, generated from MIDI_STATUS_SPEC */
+static const unsigned char midi_byte_class[256] = {
+	MIDI_X64 (MIDI_C_DATA) MIDI_X64 (MIDI_C_DATA)
+	MIDI_STATUS_SPEC (MIDI_SPEC_CLASS)
+};
+
+/* action to take by parser state and byte class */
+static const unsigned char midi_parser[MIDI_S_MAX][MIDI_C_MAX] = {
+	/* DATA, CHAN, COMMON, SYSEX, EOX, RT */
+	[MIDI_S_IDLE] = { MIDI_A_ERROR, MIDI_A_START, MIDI_A_START,
+			MIDI_A_START, MIDI_A_ERROR, MIDI_A_RT },
+	[MIDI_S_MSG] = { MIDI_A_DATA, MIDI_A_ABORT, MIDI_A_ABORT,
+			MIDI_A_ABORT, MIDI_A_ERROR, MIDI_A_RT },
+	[MIDI_S_RUN] = { MIDI_A_RUN, MIDI_A_END, MIDI_A_END,
+			MIDI_A_END, MIDI_A_END, MIDI_A_RT },
+	[MIDI_S_SYSEX] = { MIDI_A_SYSEX, MIDI_A_ABORT, MIDI_A_ABORT,
+			MIDI_A_ABORT, MIDI_A_EOX, MIDI_A_RT }
+};
+
+/* Reset the parser of a source, dropping the frame in progress. */
+static void
+midi_reader_reset_parser (midi_reader_source_t *src)
+{
+	src->state = MIDI_S_IDLE;
+	src->running = 0;
+	src->need = 0;
+	src->cold->sysex_len = 0;
+	midi_frame_reset (&src->cold->current);
+}
+
+/* Count a parsing error and reset the parser. */
+static midi_frame_state_t
+midi_reader_error (midi_reader_t *reader, midi_reader_source_t *src)
+{
+	src->cold->stats.errors++;
+	reader->total.errors++;
+	midi_reader_reset_parser (src);
+	return (MIDIF_ERROR);
+}
+
+/* Process the current frame and start over. */
+static midi_frame_state_t
+midi_reader_complete (midi_reader_t *reader, midi_reader_source_t *src)
+{
+	midi_frame_state_t r;
+
+	r = midi_frame_process (reader, &src->cold->current, src);
+	src->state = MIDI_S_IDLE;
+	src->cold->sysex_len = 0;
+	midi_frame_reset (&src->cold->current);
+	return (r);
+}
+
+/* Process the complete running status messages of the current frame, and
+ * keep the running status and the partial message for the next ones.
+ */
+static midi_frame_state_t
+midi_reader_flush_run (midi_reader_t *reader, midi_reader_source_t *src)
+{
+	midi_frame_t *mf = &src->cold->current;
+	midi_frame_state_t r;
+	unsigned char part[2];
+	int n = 0;
+
+	if (src->need > 0)
+		n = midi_frame_len[src->running - 0x80] - 1 - src->need;
+	if (mf->len - n < 2)
+		return (MIDIF_NEXT);
+	mf->len -= n;
+	memcpy (part, mf->data + mf->len, n);
+	r = midi_frame_process (reader, mf, src);
+	mf->time = src->time;
+	mf->data[0] = src->running;
+	memcpy (mf->data + 1, part, n);
+	mf->len = 1 + n;
+	return (r);
+}
+
+/* Start a new frame with a status byte. */
+static midi_frame_state_t
+midi_reader_start (midi_reader_t *reader, midi_reader_source_t *src,
+			unsigned char b)
+{
+	midi_frame_t *mf = &src->cold->current;
+
+	mf->time = src->time;
+	mf->source = src->id;
+	mf->data[0] = b;
+	mf->len = 1;
+	src->cold->sysex_len = 0;
+	switch (midi_byte_class[b]) {
+	case MIDI_C_SYSEX:
+		src->running = 0;
+		src->state = MIDI_S_SYSEX;
+		return (MIDIF_NEXT);
+	case MIDI_C_EOX:
+		return (midi_reader_error (reader, src));
+	case MIDI_C_CHAN:
+		src->running = b;
+		break;
+	default:
+		src->running = 0;
+		break;
+	}
+	src->need = midi_frame_len[b - 0x80] - 1;
+	if (src->need == 0)
+		return (midi_reader_complete (reader, src));
+	src->state = MIDI_S_MSG;
+	return (MIDIF_NEXT);
+}
+
+/* Process a real-time byte as a frame of its own, ahead of the frame in
+ * progress which is left untouched, running status included.
+ */
+static midi_frame_state_t
+midi_reader_realtime (midi_reader_t *reader, midi_reader_source_t *src,
+			unsigned char b)
+{
+	midi_frame_t f;
+	midi_frame_state_t r;
+
+	f.time = src->time;
+	f.source = src->id;
+	f.len = 1;
+	f.data[0] = b;
+	r = midi_frame_process (reader, &f, src);
+	if (src->state == MIDI_S_IDLE)
+		return (r);
+	src->cold->stats.interleaved++;
+	reader->total.interleaved++;
+	return (MIDIF_NEXT);
+}
+
 static midi_frame_state_t
 midi_reader_push_byte (midi_reader_t *reader, midi_reader_source_t *src,
 			int data)
 {
-	int len;
-	midi_frame_t *mf = &src->current;
-	unsigned char b;
+	midi_frame_t *mf = &src->cold->current;
+	unsigned char b, action;
 	midi_frame_state_t r;
 
-	b = (unsigned char) data;
 	if (data < 0)
-		r = MIDIF_NODATA;
-	else if (data > 0xFF)
-		r = MIDIF_IOERROR;
-	else if (mf->len == MIDI_FRAME_MAX) {
-		/* error, too long frame */
-		r = MIDIF_ERROR;
-	}
-	else if (src->running != 0 && (b & 0x80) != 0) {
-		src->push_back = b;
-		src->running = 0;
-		if (mf->len == 0 || ((mf->len - 1) % 2))
-			r = MIDIF_ERROR;
-		else
-			r = midi_frame_process (reader, mf, src);
+		return (MIDIF_NODATA);
+	else if (data > 0xFF) {
+		midi_reader_error (reader, src);
+		return (MIDIF_IOERROR);
 	}
-	else {
-		if (mf->len == 0) {
-			if (b >= 0x80 && b <= 0xef)
-				src->running = b;
-			else
-				src->running = 0;
-		}
+	b = (unsigned char) data;
+	action = midi_parser[src->state][midi_byte_class[b]];
 
-		mf->data[mf->len++] = (unsigned char) b;
-		if ( ! (mf->data[0] & 0x80)) {
-			/* bad byte */
-			r = MIDIF_ERROR;
+	switch (action) {
+	case MIDI_A_START:
+		return (midi_reader_start (reader, src, b));
+	case MIDI_A_DATA:
+		mf->data[mf->len++] = b;
+		if (--src->need > 0)
+			return (MIDIF_NEXT);
+		else if (src->running == 0)
+			return (midi_reader_complete (reader, src));
+		src->state = MIDI_S_RUN;
+		if (src->expand)
+			return (midi_reader_flush_run (reader, src));
+		return (MIDIF_NEXT);
+	case MIDI_A_RUN:
+		r = MIDIF_NEXT;
+		if (src->need == 0) {
+			/* next message, flush the frame if it is full */
+			src->need = midi_frame_len[src->running - 0x80] - 1;
+			/* a UMP word per message, see MIDIR_UMP */
+			if (mf->len + src->need > MIDI_FRAME_MAX ||
+			    ((reader->flags & MIDIR_UMP) && (mf->len - 1) /
+					src->need >= MIDI_FRAME_MAX / 4))
+				r = midi_reader_flush_run (reader, src);
+			if (mf->len == 1)
+				mf->time = src->time;
 		}
-		else {
-			len = midi_frame_len[mf->data[0] - 0x80];
-			if (len == -0xf0 && mf->len > 1) {
-				/* system exclusive */
-				if (b == 0xf7) {
-					r = midi_frame_process (reader,
-								mf, src);
-				}
-				else
-					r = MIDIF_NEXT;
-			}
-			else if (src->running == 0 && len == mf->len)
-				r = midi_frame_process (reader, mf, src);
-			else
-				r = MIDIF_NEXT;
+		mf->data[mf->len++] = b;
+		if (--src->need == 0 && src->expand)
+			r = midi_reader_flush_run (reader, src);
+		return (r);
+	case MIDI_A_END:
+		if (src->need == 0)
+			r = midi_reader_flush_run (reader, src);
+		else
+			r = midi_reader_error (reader, src);
+		if (midi_reader_start (reader, src, b) == MIDIF_ERROR)
+			r = MIDIF_ERROR;
+		return (r);
+	case MIDI_A_ABORT:
+		midi_reader_error (reader, src);
+		midi_reader_start (reader, src, b);
+		return (MIDIF_ERROR);
+	case MIDI_A_RT:
+		return (midi_reader_realtime (reader, src, b));
+	case MIDI_A_SYSEX:
+	case MIDI_A_EOX:
+		if (src->cold->sysex_len == 0 && mf->len < MIDI_FRAME_MAX) {
+			mf->data[mf->len++] = b;
+			if (action == MIDI_A_SYSEX)
+				return (MIDIF_NEXT);
+			return (midi_reader_complete (reader, src));
 		}
-	}
-
-	switch (r) {
-	case MIDIF_ERROR:
-	case MIDIF_IOERROR:
-		src->stats.errors++;
-		src->running = 0;
-		reader->total.errors++;
-		break;
+		/* long system exclusive frame */
+		r = midi_reader_push_sysex (reader, src, b);
+		if (r == MIDIF_ERROR)
+			return (midi_reader_error (reader, src));
+		else if (r != MIDIF_NEXT)
+			midi_reader_reset_parser (src);
+		return (r);
 	default:
-		break;
+		return (midi_reader_error (reader, src));
 	}
-	return (r);
 }
 
 int
 midi_reader_inject (midi_reader_t *reader, midi_frame_t *mf)
 {
+	return (midi_reader_inject_from (reader, mf, MIDI_SOURCE_NONE));
+}
+
+int
+midi_reader_inject_from (midi_reader_t *reader, midi_frame_t *mf,
+				uint16_t source)
+{
+	midi_reader_source_cold_t cold;
 	midi_reader_source_t src;
 	midi_frame_state_t r;
 	int i;
 
 	if (reader == NULL || mf == NULL || mf->len == 0)
 		return (0);
+	memset (&cold, 0, sizeof (cold));
+	memset (&src, 0, sizeof (src));
+	src.cold = &cold;
 	midi_reader_reset_source (&src, false);
 	src.fd = -1;
+	src.id = source;
+	src.expand = (reader->flags & MIDIR_EXPAND) != 0;
+	src.time = midi_reader_time (reader);
 	for (i = 0; i < mf->len; i++) {
 		r = midi_reader_push_byte (reader, &src, mf->data[i]);
-		switch (r) {
-		case MIDIF_COMPLETE:
-		case MIDIF_NEXT:
-			continue;
-		default:
-			return (i);
-		}
+		if (r != MIDIF_COMPLETE && r != MIDIF_NEXT)
+			break;
 	}
-	/* push a fake active-sensing to conclude any pending running-status
-	 * frame */
-	if (src.running != 0)
-		midi_reader_push_byte (reader, &src, 0xfe);
+	/* conclude any pending running status frame */
+	if (i == mf->len && src.state == MIDI_S_RUN)
+		midi_reader_flush_run (reader, &src);
+	free (cold.sysex);
+	if ( ! (reader->flags & MIDIR_DUMPASYNC))
+		midi_reader_flush_dump (reader);
 	return (i);
 }
 
@@ -502,19 +1368,47 @@ midi_reader_inject_bytes (midi_reader_t *reader, int n, ...)
 void
 midi_frame_dump (midi_frame_t *mf, int fd)
 {
-	if (fd > -1 && mf) {
-		for (int j = 0; j < mf->len; j++)
-			dprintf (fd, "%.2x ", mf->data[j]);
+	if (fd > -1 && mf)
+		midi_bytes_dump (mf->data, mf->len, fd);
+}
+
+void
+midi_qframe_dump (const midi_qframe_t *qf, int fd)
+{
+	if (fd > -1 && qf)
+		midi_bytes_dump (qf->data, qf->len, fd);
+}
+
+void
+midi_reader_set_budget (midi_reader_t *reader, int budget)
+{
+	if (reader && budget >= 0)
+		reader->budget = budget;
+}
+
+/* Parse at most 'budget' bytes (or all if 0) of a source. */
+static void
+midi_reader_parse_src (midi_reader_t *reader, int src, int budget)
+{
+	midi_reader_source_t *s = &reader->sources[src];
+	int b, n;
+
+	for (n = 0; budget == 0 || n < budget; n++) {
+		b = midi_reader_get_byte (reader, src);
+		if (b < 0) {
+			/* buffer drained, conclude running status messages */
+			if (s->state == MIDI_S_RUN)
+				midi_reader_flush_run (reader, s);
+			return;
+		}
+		midi_reader_push_byte (reader, s, b);
 	}
 }
 
 bool
 midi_reader_update (midi_reader_t *reader)
 {
-	static int start = -1;
-	midi_frame_state_t r;
-	midi_reader_source_t *s;
-	int src, i, b;
+	int src, i;
 
 	if (reader == NULL)
 		return (false);
@@ -522,49 +1416,243 @@ midi_reader_update (midi_reader_t *reader)
 	/* read all sources */
 	midi_reader_read (reader);
 
-	/* fill the queue */
-	if (++start >= reader->nsources)
-		start = 0;
-	for (src = start, i = 0; i < reader->nsources; i++, src++) {
+	/* fill the queue, starting with a different source each time */
+	if (++reader->start >= reader->nsources)
+		reader->start = 0;
+	for (src = reader->start, i = 0; i < reader->nsources; i++, src++) {
 		if (src >= reader->nsources)
 			src = 0;
+		midi_reader_parse_src (reader, src, reader->budget);
+	}
+	if ( ! (reader->flags & MIDIR_DUMPASYNC))
+		midi_reader_flush_dump (reader);
 
-		s = &reader->sources[src];
-		b = midi_reader_get_byte (reader, src);
-		r = midi_reader_push_byte (reader, &reader->sources[src], b);
-		switch (r) {
-		case MIDIF_COMPLETE:
-		case MIDIF_ERROR:
-		case MIDIF_IOERROR:
-		case MIDIF_SKIPPED:
-			midi_frame_reset (&s->current);
-			break;
-		case MIDIF_NODATA:
-		case MIDIF_NEXT:
-			break;
-		}
+	return (reader->frames.head !=
+		__atomic_load_n (&reader->frames.tail, __ATOMIC_ACQUIRE));
+}
+
+bool
+midi_reader_pending (midi_reader_t *reader)
+{
+	midi_reader_source_t *s;
+
+	if (reader == NULL)
+		return (false);
+	for (int i = 0; i < reader->nsources; i++) {
+		s = &reader->sources[i];
+		if (s->buf_offset < s->buf_len)
+			return (true);
+	}
+	return (false);
+}
+
+const midi_qframe_t*
+midi_reader_peek (midi_reader_t *reader)
+{
+	midi_frames_t *q;
+	midi_qframe_t *qf;
+	uint32_t head, end;
+
+	if (reader == NULL)
+		return (NULL);
+	q = &reader->frames;
+	head = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+	while (q->tail != head) {
+		end = q->size - (q->tail & (q->size - 1));
+		qf = midi_reader_qframe_at (q, q->tail);
+		if (end >= sizeof (midi_qframe_t) &&
+					qf->len != MIDI_QFRAME_WRAP)
+			return (qf);
+		/* next frame is at start of the queue */
+		__atomic_store_n (&q->tail, q->tail + end, __ATOMIC_RELEASE);
 	}
-	
-	return (reader->frames.len > 0 &&
-		reader->frames.offset < reader->frames.len);
+	return (NULL);
+}
+
+void
+midi_reader_commit (midi_reader_t *reader)
+{
+	const midi_qframe_t *qf = midi_reader_peek (reader);
+
+	if (qf) {
+		__atomic_store_n (&reader->frames.tail, reader->frames.tail +
+				MIDI_QFRAME_SIZE (qf->len), __ATOMIC_RELEASE);
+	}
+}
+
+/* Position of the frame stored at or after 'pos', skipping the end of the
+ * queue when it is marked unused, or 'head' if there is none.
+ */
+static uint32_t
+midi_reader_next_pos (midi_frames_t *q, uint32_t pos, uint32_t head)
+{
+	uint32_t end;
+
+	if (pos != head) {
+		end = q->size - (pos & (q->size - 1));
+		if (end < sizeof (midi_qframe_t) ||
+				midi_reader_qframe_at (q, pos)->len == MIDI_QFRAME_WRAP)
+			pos += end;
+	}
+	return (pos);
+}
+
+int
+midi_reader_peek_batch (midi_reader_t *reader, const midi_qframe_t **frames,
+			int max)
+{
+	midi_frames_t *q;
+	uint32_t head, pos;
+	int n = 0;
+
+	if (reader == NULL || frames == NULL)
+		return (0);
+	q = &reader->frames;
+	head = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+	pos = q->tail;
+	while (n < max && (pos = midi_reader_next_pos (q, pos, head)) != head) {
+		frames[n] = midi_reader_qframe_at (q, pos);
+		pos += MIDI_QFRAME_SIZE (frames[n]->len);
+		n++;
+	}
+	return (n);
+}
+
+void
+midi_reader_commit_batch (midi_reader_t *reader, int n)
+{
+	midi_frames_t *q;
+	uint32_t head, pos;
+
+	if (reader == NULL || n <= 0)
+		return;
+	q = &reader->frames;
+	head = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+	pos = q->tail;
+	while (n-- > 0 && (pos = midi_reader_next_pos (q, pos, head)) != head)
+		pos += MIDI_QFRAME_SIZE (midi_reader_qframe_at (q, pos)->len);
+	__atomic_store_n (&q->tail, pos, __ATOMIC_RELEASE);
 }
 
 midi_frame_t*
 midi_reader_get_next (midi_reader_t *reader)
 {
+	const midi_qframe_t *qf;
+
 	if ( ! midi_reader_update (reader))
 		return (NULL);
-	else
-		return (&reader->frames.frames[reader->frames.offset++]);
+	while ((qf = midi_reader_peek (reader)) != NULL &&
+						qf->len > MIDI_FRAME_MAX) {
+		reader->total.missed++;
+		midi_reader_commit (reader);
+	}
+	if (qf == NULL)
+		return (NULL);
+	reader->next.time = qf->time;
+	reader->next.source = qf->source;
+	reader->next.len = qf->len;
+	memcpy (reader->next.data, qf->data, qf->len);
+	midi_reader_commit (reader);
+	return (&reader->next);
+}
+
+int
+midi_reader_get_batch (midi_reader_t *reader, midi_frame_t *frames, int max)
+{
+	const midi_qframe_t *qf;
+	int n = 0;
+
+	if (reader == NULL || frames == NULL || max <= 0)
+		return (0);
+	midi_reader_update (reader);
+	while (n < max && (qf = midi_reader_peek (reader)) != NULL) {
+		if (qf->len > MIDI_FRAME_MAX)
+			reader->total.missed++;
+		else {
+			frames[n].time = qf->time;
+			frames[n].source = qf->source;
+			frames[n].len = qf->len;
+			memcpy (frames[n].data, qf->data, qf->len);
+			n++;
+		}
+		midi_reader_commit (reader);
+	}
+	return (n);
 }
 
 void
 midi_reader_clear_queue (midi_reader_t *reader)
 {
-	if (reader->frames.len > 0) {
-		memset (&reader->frames, 0,
-			sizeof (midi_frames_t));
+	if (reader) {
+		__atomic_store_n (&reader->frames.tail,
+			__atomic_load_n (&reader->frames.head, __ATOMIC_ACQUIRE),
+			__ATOMIC_RELEASE);
+	}
+}
+
+int
+midi_reader_flush_dump (midi_reader_t *reader)
+{
+	static const char hex[] = "0123456789abcdef";
+	midi_dump_t *d;
+	char out[3 * 1024];
+	uint32_t head, tail, off, n, i;
+	bool ok = true;
+
+	if (reader == NULL || reader->dumpfd < 0)
+		return (0);
+	d = &reader->dump;
+	head = __atomic_load_n (&d->head, __ATOMIC_ACQUIRE);
+	tail = d->tail;
+	while (ok && tail != head) {
+		off = tail & (d->size - 1);
+		n = d->size - off;
+		if (n > head - tail)
+			n = head - tail;
+		if (reader->flags & MIDIR_DUMPHEX) {
+			if (n > sizeof (out) / 3)
+				n = sizeof (out) / 3;
+			for (i = 0; i < n; i++) {
+				out[3 * i] = hex[d->buf[off + i] >> 4];
+				out[3 * i + 1] = hex[d->buf[off + i] & 0x0f];
+				out[3 * i + 2] = ' ';
+			}
+			ok = midi_reader_write_all (reader->dumpfd, out, 3 * n);
+		}
+		else {
+			ok = midi_reader_write_all (reader->dumpfd,
+					(const char*) d->buf + off, n);
+		}
+		tail += n;
+		__atomic_store_n (&d->tail, tail, __ATOMIC_RELEASE);
+	}
+	return (ok ? (int) (head - tail) : -1);
+}
+
+uint32_t
+midi_reader_dump_pending (midi_reader_t *reader)
+{
+	if (reader == NULL)
+		return (0);
+	return (__atomic_load_n (&reader->dump.head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n (&reader->dump.tail, __ATOMIC_ACQUIRE));
+}
+
+void
+midi_reader_get_queue_usage (midi_reader_t *reader, uint32_t *used,
+				uint32_t *high)
+{
+	midi_frames_t *q;
+
+	if (reader == NULL)
+		return;
+	q = &reader->frames;
+	if (used) {
+		*used = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE) -
+			__atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
 	}
+	if (high)
+		*high = __atomic_load_n (&q->high, __ATOMIC_RELAXED);
 }
 
 bool
@@ -575,7 +1663,7 @@ midi_reader_get_stats (midi_reader_t *reader, int n, midi_reader_stats_t *stats)
 	if (n == -1)
 		*stats = reader->total;
 	else
-		*stats = reader->sources[n].stats;
+		*stats = reader->sources[n].cold->stats;
 	return (true);
 }
 
@@ -587,9 +1675,57 @@ midi_reader_reset_stats (midi_reader_t *reader, int n)
 	else if (n == -1)
 		memset (&reader->total, 0, sizeof (midi_reader_stats_t));
 	else {
-		memset (&reader->sources[n].stats, 0,
+		memset (&reader->sources[n].cold->stats, 0,
 			sizeof (midi_reader_stats_t));
 	}
 
 }
 
+bool
+midi_log_open (midi_log_t *log, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	if (log == NULL || p == NULL || len < MIDI_LOG_HEADER ||
+				memcmp (p, MIDI_LOG_MAGIC, 8) != 0)
+		return (false);
+	log->data = p;
+	log->len = len;
+	log->off = MIDI_LOG_HEADER;
+	log->time = 0;
+	for (int i = 7; i >= 0; i--)
+		log->time = (log->time << 8) | p[8 + i];
+	return (true);
+}
+
+int
+midi_log_next (midi_log_t *log, midi_log_frame_t *f)
+{
+	uint64_t dt, source, len;
+	size_t off;
+	int n;
+
+	if (log == NULL || f == NULL)
+		return (-1);
+	off = log->off;
+	if (off == log->len)
+		return (0);
+	if ((n = midi_varint_get (log->data + off, log->len - off, &dt)) == 0)
+		return (-1);
+	off += n;
+	n = midi_varint_get (log->data + off, log->len - off, &source);
+	if (n == 0 || source > 0xffff)
+		return (-1);
+	off += n;
+	n = midi_varint_get (log->data + off, log->len - off, &len);
+	if (n == 0 || len > log->len - off - n)
+		return (-1);
+	off += n;
+	log->time += (uint64_t) ((dt >> 1) ^ -(dt & 1));
+	f->time = log->time;
+	f->source = source;
+	f->len = len;
+	f->data = log->data + off;
+	log->off = off + len;
+	return (1);
+}
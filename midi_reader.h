@@ -28,12 +28,13 @@
 #define MIDI_READER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define MIDI_READER_VERSION	104
+#define MIDI_READER_VERSION	121
 
 /* state of MIDI frame */
 typedef enum midi_frame_state_t {
@@ -48,22 +49,71 @@ typedef enum midi_frame_state_t {
 /* max count of bytes in a MIDI frame */
 #define MIDI_FRAME_MAX	128
 
+/* max count of bytes in a system exclusive frame; longer ones than
+ * MIDI_FRAME_MAX are stored in a growable buffer of the source */
+#define MIDI_READER_SYSEX_MAX	32768
+
 /* MIDI frame */
 typedef struct midi_frame_t {
+	uint64_t time; /* arrival time of the first byte (reader clock) */
+	uint16_t source; /* identifier of the source */
 	unsigned char len; /* current length */
 	unsigned char data[MIDI_FRAME_MAX]; /* data bytes */
 } midi_frame_t;
 
-/* max count of frames in midi_frames_t */
-#define MIDI_READER_FRAMES_MAX	1024
+/* default size in bytes of the queue storing the frames in midi_frames_t,
+ * see "midi_reader_init_sized" */
+#define MIDI_READER_QUEUE_SIZE	131072
 
-/* an array of MIDI frames */
+/* MIDI frame as stored in the queue, size is rounded to 8 bytes. With
+ * MIDIR_UMP, data holds 'words' 32-bit words, aligned, see
+ * "midi_reader_ump_words".
+ */
+typedef struct midi_qframe_t {
+	uint64_t time; /* arrival time of the first byte (reader clock) */
+	uint32_t len; /* count of data bytes */
+	uint16_t source; /* identifier of the source */
+	uint16_t words; /* count of UMP words in data, 0 for MIDI bytes */
+	unsigned char data[]; /* data bytes */
+} midi_qframe_t;
+
+/* UMP words of a frame stored with MIDIR_UMP */
+#define MIDI_QFRAME_WORDS(qf)	((const uint32_t *) (qf)->data)
+
+/* size used in the queue by a frame of 'n' bytes */
+#define MIDI_QFRAME_SIZE(n)	((sizeof (midi_qframe_t) + (n) + 7) & ~7UL)
+
+/* length of the marker telling that next frame is at start of the queue */
+#define MIDI_QFRAME_WRAP	0xffffffffU
+
+/* Circular queue of MIDI frames, stored one after the other. There is a
+ * single producer ("midi_reader_update") and a single consumer
+ * ("midi_reader_peek", "midi_reader_commit", "midi_reader_clear_queue"),
+ * which may run in two threads without any lock. 'head' and 'tail' are
+ * free-running byte counters.
+ */
 typedef struct midi_frames_t {
-	int len; /* current length */
-	int offset; /* current offset */
-	midi_frame_t frames[MIDI_READER_FRAMES_MAX]; /* the frames */
+	uint32_t head; /* where next frame is stored, producer */
+	uint32_t tail; /* where next frame is read, consumer */
+	uint32_t high; /* max count of bytes used, producer */
+	uint32_t size; /* size of the queue in bytes, a power of 2 */
+	uint64_t *queue; /* the frames */
 } midi_frames_t;
 
+/* default size of the dump buffer, see "midi_reader_init_sized" */
+#define MIDI_READER_DUMP_SIZE	65536
+
+/* Circular buffer of the bytes to dump, with a single producer (the
+ * parser) and a single consumer ("midi_reader_flush_dump"). 'head' and
+ * 'tail' are free-running byte counters.
+ */
+typedef struct midi_dump_t {
+	uint32_t head; /* where next byte is stored, producer */
+	uint32_t tail; /* where next byte is written, consumer */
+	uint32_t size; /* size of buf, a power of 2 */
+	unsigned char *buf; /* allocated with the dump file descriptor */
+} midi_dump_t;
+
 /* flags for the MIDI reader */
 typedef enum midi_reader_flags_t
 {
@@ -71,6 +121,9 @@ typedef enum midi_reader_flags_t
 	MIDIR_DEBUG = 1, /* show frame content when it is read */
 	MIDIR_EXPAND = 2, /* expand running status frames */
 	MIDIR_DUMPHEX = 4, /* dump in hex format, not binary */
+	MIDIR_DUMPASYNC = 8, /* dump only in "midi_reader_flush_dump" */
+	MIDIR_DUMPLOG = 16, /* dump in binary log format, see midi_log_t */
+	MIDIR_UMP = 32, /* store frames as UMP words, see midi_reader_ump_words */
 } midi_reader_flags_t;
 
 /* User callback function called each time a MIDI frame is read and validated.
@@ -78,14 +131,26 @@ typedef enum midi_reader_flags_t
  * queue and so will be returned by a call to "midi_reader_get_next".
  * When it returns MIDIF_SKIPPED or another value, the frame is not stored in
  * the queue nor dump'ed.
+ * System exclusive frames longer than MIDI_FRAME_MAX are not passed to the
+ * callback; they are always stored, and can only be read with
+ * "midi_reader_peek".
+ * A real-time byte (0xF8-0xFF) arriving in the middle of a frame, system
+ * exclusive and running status included, is passed at once as a 1-byte
+ * frame; the interrupted frame follows when it is complete.
  */
 typedef midi_frame_state_t (*midi_reader_callback_t) (midi_frame_t* mf,
 							void *user_data);
 
+/* User clock function, used to timestamp the frames. It is called once
+ * after each successful read on a source; all the bytes returned by this
+ * read get the same time.
+ */
+typedef uint64_t (*midi_reader_clock_t) (void *user_data);
+
 /* max length of read buffer */
 #define MIDI_READER_BUF_MAX	256
 
-/* max count of input devices */
+/* default max count of input devices, see "midi_reader_init_sized" */
 #define MIDI_READER_IN_MAX	64
 
 /* input buffer */
@@ -98,65 +163,181 @@ typedef struct midi_reader_stats_t
 	unsigned long errors; /* count of erroneous incoming frames */
 	unsigned long skipped; /* count of frames read but skipped */
 	unsigned long missed; /* frames not stored in queue */
+	unsigned long interleaved; /* real-time frames read inside a frame */
+	unsigned long dump_lost; /* frames not dumped, dump buffer full */
 } midi_reader_stats_t;
 
-/* source of data */
-typedef struct midi_reader_source_t {
-	int fd; /* file descriptors to read from */
-	unsigned char running; /* current running status command or 0 */
+/* source identifier of injected frames */
+#define MIDI_SOURCE_NONE	0xffff
+
+/* Transform of the channel messages of a source, applied in place after
+ * the filters with table lookups only. It is built by
+ * "midi_reader_transform_init" and the other midi_reader_transform_*
+ * functions, see "midi_reader_set_transform". Channels are 0-15 here.
+ */
+typedef struct midi_reader_transform_t {
+	unsigned char channel[16]; /* new channel, by channel */
+	unsigned char note[128]; /* new note of a note message, 0xff: skip */
+	unsigned char note_channel[128]; /* channel of a note, by note before
+					  * transposition, 0xff: by channel */
+	unsigned char velocity[128]; /* new velocity of a note-on */
+	unsigned char cc[128]; /* new controller of a control change */
+	bool split; /* some note has a note_channel */
+} midi_reader_transform_t;
+
+/* buffers and statistics of a source, out of the parser state */
+typedef struct midi_reader_source_cold_t {
 	midi_reader_buf_t buf; /* input buffer */
-	int buf_len; /* current buf length */
-	int buf_offset; /* current offset in buf */
-	int push_back; /* byte pushed-back or -1 if none */
 	midi_frame_t current; /* frame being parsed */
-	int channel; /* if 1-16, channel to update */
+	unsigned char *sysex; /* long system exclusive frame being parsed */
+	uint32_t sysex_len; /* its length, 0 if none */
+	uint32_t sysex_size; /* allocated size of sysex */
 	midi_reader_stats_t stats;
+	midi_reader_transform_t *transform; /* transform or NULL */
+} midi_reader_source_cold_t;
+
+/* source of data: the state used for each byte, kept small so that the
+ * sources of a reader share a few cache lines */
+typedef struct midi_reader_source_t {
+	int fd; /* file descriptors to read from */
+	uint16_t id; /* identifier of the source, stored in its frames */
+	unsigned char running; /* current running status command or 0 */
+	unsigned char state; /* parser state */
+	unsigned char need; /* data bytes missing in the current message */
+	unsigned char expand; /* frames hold a single message */
+	uint16_t buf_len; /* current buf length */
+	uint16_t buf_offset; /* current offset in buf */
+	uint64_t time; /* time of the last read */
+	midi_reader_source_cold_t *cold; /* buffers and statistics */
 } midi_reader_source_t;
 
 /* used to read bytes and store MIDI frames */
 typedef struct midi_reader_t
 {
 	midi_reader_flags_t flags; /* reader flags */
-	midi_reader_source_t sources[MIDI_READER_IN_MAX]; /* input sources */
+	midi_reader_source_t *sources; /* input sources */
 	int nsources; /* count of input devices */
+	int max_sources; /* size of sources */
+	midi_reader_source_cold_t *cold; /* cold parts of the sources */
 	int dumpfd; /* dump file descriptor */
+	midi_dump_t dump; /* bytes to dump */
+	bool log_started; /* log header was dumped */
+	uint64_t log_time; /* time of the last frame logged */
 	midi_frames_t frames; /* frames that were read */
-	const unsigned char *to_skip; /* status bytes to skip */
+	uint32_t skip[8]; /* bitmap of status bytes to skip */
+	uint32_t skip_cc[16][4]; /* bitmap of controllers to skip by channel */
+	bool has_skip_cc; /* some bit is set in skip_cc */
 	midi_reader_callback_t callback; /* callback function */
 	void *user_data; /* user data for callback */
+	midi_reader_clock_t clock; /* clock function or NULL */
+	void *clock_data; /* user data for clock */
 	midi_reader_stats_t total; /* cumulated stats */
+	int start; /* first source to parse on next update */
+	int budget; /* bytes parsed per source and update, 0: all */
+	midi_frame_t next; /* frame returned by midi_reader_get_next */
 } midi_reader_t;
 
-/* list of possible MIDI frames length indexed by the status byte.
- * -1: error, -xx: variable length, > 0 fixed (minimal for running status)
- * length
+/* classes of bytes, as seen by the parser */
+typedef enum midi_byte_class_t {
+	MIDI_C_DATA = 0, /* data byte */
+	MIDI_C_CHAN, /* channel message status */
+	MIDI_C_COMMON, /* system common message status */
+	MIDI_C_SYSEX, /* start of system exclusive */
+	MIDI_C_EOX, /* end of system exclusive */
+	MIDI_C_RT, /* system real-time message */
+	MIDI_C_MAX
+} midi_byte_class_t;
+
+/* helpers repeating a table value */
+#define MIDI_X1(v)	v,
+#define MIDI_X2(v)	MIDI_X1 (v) MIDI_X1 (v)
+#define MIDI_X4(v)	MIDI_X2 (v) MIDI_X2 (v)
+#define MIDI_X8(v)	MIDI_X4 (v) MIDI_X4 (v)
+#define MIDI_X16(v)	MIDI_X8 (v) MIDI_X8 (v)
+#define MIDI_X64(v)	MIDI_X16 (v) MIDI_X16 (v) MIDI_X16 (v) MIDI_X16 (v)
+
+/* Specification of the status bytes 0x80-0xFF, from which the tables of
+ * the parser are generated: R (repeat, length, class). The length is -1
+ * on error, -xx for variable length, > 0 for fixed length (minimal for
+ * running status).
  */
+#define MIDI_STATUS_SPEC(R) \
+	R (MIDI_X16, 3, MIDI_C_CHAN)		/* 80 note off */ \
+	R (MIDI_X16, 3, MIDI_C_CHAN)		/* 90 note on */ \
+	R (MIDI_X16, 3, MIDI_C_CHAN)		/* A0 aftertouch */ \
+	R (MIDI_X16, 3, MIDI_C_CHAN)		/* B0 control change */ \
+	R (MIDI_X16, 2, MIDI_C_CHAN)		/* C0 program change */ \
+	R (MIDI_X16, 2, MIDI_C_CHAN)		/* D0 pressure */ \
+	R (MIDI_X16, 3, MIDI_C_CHAN)		/* E0 pitch bend */ \
+	R (MIDI_X1, -0xf0, MIDI_C_SYSEX)	/* F0 system exclusive */ \
+	R (MIDI_X1, 2, MIDI_C_COMMON)		/* F1 time code */ \
+	R (MIDI_X1, 3, MIDI_C_COMMON)		/* F2 song position */ \
+	R (MIDI_X1, 2, MIDI_C_COMMON)		/* F3 song select */ \
+	R (MIDI_X2, 1, MIDI_C_COMMON)		/* F4-F5 undefined */ \
+	R (MIDI_X1, 1, MIDI_C_COMMON)		/* F6 tune request */ \
+	R (MIDI_X1, 1, MIDI_C_EOX)		/* F7 end of exclusive */ \
+	R (MIDI_X8, 1, MIDI_C_RT)		/* F8 system real-time */
+
+#define MIDI_SPEC_LEN(rep, len, class)	rep (len)
+#define MIDI_SPEC_CLASS(rep, len, class)	rep (class)
+
+/* list of possible MIDI frames length indexed by the status byte - 0x80 */
 static const int midi_frame_len[128] = {
-	/* 80 note off */ 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-	/* 90 note on */  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-	/* A0 aftertouch */  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-	/* B0 control change */ 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-	/* C0 program change */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-	/* D0 pressure */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-	/* E0 pitch bend */  3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-	/* F0 system common */ -0xf0, 2, 3, 2, 1, 1, 1, 1,
-	/* F8 system real-time */ 1, 1, 1, 1, 1, 1, 1, 1
+	MIDI_STATUS_SPEC (MIDI_SPEC_LEN)
 };
 
 /* Get the version of the library as a 3-digits number (100, 101,..). */
 int midi_reader_get_version ();
 
-/* Initialize a MIDI reader. 'to_skip' may be NULL or a pointer to a ZERO-
- * terminated array of status bytes; frames starting with one of these bytes
- * will be skipped. User should call "midi_reader_add_source" after this.
+/* Initialize a MIDI reader with the default capacities. 'to_skip' may be
+ * NULL or a pointer to a ZERO-terminated array of status bytes; frames
+ * starting with one of these bytes will be skipped (see also
+ * "midi_reader_filter_status"). User should call "midi_reader_add_source"
+ * after this, and "midi_reader_destroy" to free the reader. Return false
+ * if memory could not be allocated.
  */
-void
+bool
 midi_reader_init (midi_reader_t* reader, midi_reader_flags_t flags,
 			const unsigned char *to_skip);
 
+/* Same as "midi_reader_init" with capacities chosen by the caller, or the
+ * default ones when 0: the max count of sources, the size in bytes of the
+ * frame queue and of the dump buffer, which are rounded up to a power of 2
+ * (at least 1024). The dump buffer is only allocated by
+ * "midi_reader_set_dump_fd". A frame longer than half of the queue may not
+ * be stored.
+ */
+bool
+midi_reader_init_sized (midi_reader_t* reader, midi_reader_flags_t flags,
+			const unsigned char *to_skip, int max_sources,
+			uint32_t queue_size, uint32_t dump_size);
+
+/* Skip the frames with a status byte between 'lo' and 'hi'. For example
+ * 0x90-0x9f skips all the note-on messages, 0x93-0x93 only the ones on
+ * channel 4. Return false on failure.
+ */
+bool
+midi_reader_filter_status (midi_reader_t *reader, int lo, int hi);
+
+/* Skip all the channel messages (0x8n-0xEn) of the given channel (1-16).
+ * Return false on failure.
+ */
+bool
+midi_reader_filter_channel (midi_reader_t *reader, int channel);
+
+/* Skip the control changes of controllers 'lo' to 'hi' on the given channel
+ * (1-16, or 0 for all channels). In a running status frame, only the
+ * matching controller/value pairs are removed. Return false on failure.
+ */
+bool
+midi_reader_filter_cc (midi_reader_t *reader, int channel, int lo, int hi);
+
 /* Add a MIDI-in file descriptor to the reader. Return false on failure.
  * If 'channel' is a value between 1 and 16, then the channel 'n' for all
- * channel-type messages (0x8n-0xEn) is changed to this value.
+ * channel-type messages (0x8n-0xEn) is changed to this value, with a
+ * transform (see "midi_reader_set_transform").
+ * The identifier of the source is its index in the sources, see
+ * "midi_reader_set_source_id".
  */
 bool
 midi_reader_add_source (midi_reader_t *reader, int fd, int channel);
@@ -166,13 +347,64 @@ bool
 midi_reader_add_source_path (midi_reader_t *reader,
 				const char *path, int channel);
 
+/* Set the identifier of a source, stored in all the frames it produces.
+ * Return false on failure.
+ */
+bool
+midi_reader_set_source_id (midi_reader_t *reader, int fd, uint16_t id);
+
+/* Set the transform of the channel messages of a source, copied, or reset
+ * it if 'xf' is NULL. When notes are split to several channels, the frames
+ * of the source are expanded (see MIDIR_EXPAND). Return false on failure.
+ */
+bool
+midi_reader_set_transform (midi_reader_t *reader, int fd,
+				const midi_reader_transform_t *xf);
+
+/* Initialize a transform which changes nothing. */
+void
+midi_reader_transform_init (midi_reader_transform_t *xf);
+
+/* Change the channel 'from' (1-16, or 0 for all channels) of the channel
+ * messages to 'to' (1-16). Return false on failure.
+ */
+bool
+midi_reader_transform_channel (midi_reader_transform_t *xf, int from, int to);
+
+/* Scale the velocities 1-127 of the note-on messages to 'lo'-'hi', with
+ * 1 <= lo <= hi <= 127; lo == hi gives a fixed velocity. Return false on
+ * failure.
+ */
+bool
+midi_reader_transform_velocity (midi_reader_transform_t *xf, int lo, int hi);
+
+/* Transpose the notes (note on/off and polyphonic pressure) by 'semitones'
+ * (-127 to 127). The notes out of range are skipped. Return false on
+ * failure.
+ */
+bool
+midi_reader_transform_transpose (midi_reader_transform_t *xf, int semitones);
+
+/* Send the notes 'lo' to 'hi' (0-127, before transposition) to the channel
+ * 'channel' (1-16), like a keyboard split. Return false on failure.
+ */
+bool
+midi_reader_transform_split (midi_reader_transform_t *xf, int lo, int hi,
+				int channel);
+
+/* Change the controller 'from' of the control changes to 'to' (0-127).
+ * Return false on failure.
+ */
+bool
+midi_reader_transform_cc (midi_reader_transform_t *xf, int from, int to);
+
 /* Remove a MIDI-in file descriptor from the reader. Return false on failure. */
 bool
 midi_reader_remove_source (midi_reader_t *reader, int fd);
 
 /* Set the file descriptor where to dump frames. Dump file will be closed if
  * function "midi_reader_close" is called.
- * Returns false on error.
+ * Returns false on error, or if the dump buffer could not be allocated.
  */
 bool
 midi_reader_set_dump_fd (midi_reader_t *reader, int fd);
@@ -183,6 +415,23 @@ midi_reader_set_dump_fd (midi_reader_t *reader, int fd);
 bool
 midi_reader_set_dump_file (midi_reader_t *reader, const char *path, bool trunc);
 
+/* Write the frames waiting in the dump buffer to the dump file, formatted
+ * in hex with MIDIR_DUMPHEX. The frames are queued in this buffer when they
+ * are stored; when it is full they are not dumped and counted in the
+ * "dump_lost" statistic. Without MIDIR_DUMPASYNC, "midi_reader_update" and
+ * "midi_reader_inject" call this function when they are done, so there is
+ * one write per update instead of one per frame. With MIDIR_DUMPASYNC, it
+ * is up to the user to call it regularly, for example in another thread
+ * than the one calling "midi_reader_update", but always the same one.
+ * Return the count of bytes left in the buffer, or -1 on write error.
+ */
+int
+midi_reader_flush_dump (midi_reader_t *reader);
+
+/* Get the count of bytes waiting in the dump buffer. */
+uint32_t
+midi_reader_dump_pending (midi_reader_t *reader);
+
 /* Set a user callback function with optional argument. Note that when using a
  * callback, you should call regularly "midi_reader_get_next" or
  * "midi_reader_clear_queue" so that the internal queue get not full.
@@ -196,6 +445,13 @@ void
 midi_reader_set_callback (midi_reader_t *reader,
 			midi_reader_callback_t cb, void *user_data);
 
+/* Set the clock function used to timestamp the frames, with optional
+ * argument. Without clock, all frames have a zero time.
+ */
+void
+midi_reader_set_clock (midi_reader_t *reader,
+			midi_reader_clock_t clock, void *user_data);
+
 /* Close a MIDI reader. Note that "midi_reader_get_next" may be called after
  * this until the frames already read and stored in the internal buffer are
  * exhausted, but no new frame will be read.
@@ -203,6 +459,12 @@ midi_reader_set_callback (midi_reader_t *reader,
 void
 midi_reader_close (midi_reader_t* reader);
 
+/* Close a MIDI reader and free its memory. It must be initialized again
+ * before any other use.
+ */
+void
+midi_reader_destroy (midi_reader_t* reader);
+
 /* Returns -1 if no midi device is readable, 0 if there is no byte to
  * read, else the count of MIDI-in devices having data to read from.
  */
@@ -225,6 +487,13 @@ midi_reader_inject (midi_reader_t *reader, midi_frame_t *mf);
 int
 midi_reader_inject_bytes (midi_reader_t *reader, int n, ...);
 
+/* Same as "midi_reader_inject", but the frame is tagged with the given
+ * source identifier instead of MIDI_SOURCE_NONE.
+ */
+int
+midi_reader_inject_from (midi_reader_t *reader, midi_frame_t *mf,
+				uint16_t source);
+
 /* Reset a MIDI frame. */
 void
 midi_frame_reset (midi_frame_t* mf);
@@ -233,19 +502,84 @@ midi_frame_reset (midi_frame_t* mf);
 void
 midi_frame_dump (midi_frame_t *mf, int fd);
 
+/* Same as "midi_frame_dump" for a frame stored in the queue. */
+void
+midi_qframe_dump (const midi_qframe_t *qf, int fd);
+
+/* Set the maximum count of bytes parsed for each source by a call to
+ * "midi_reader_update". Default is 1; if 0, all the buffered bytes of all
+ * sources are parsed at once (batch mode). Sources are parsed in a
+ * round-robin order, starting with a different one on each call.
+ */
+void
+midi_reader_set_budget (midi_reader_t *reader, int budget);
+
 /* Return true if there is a MIDI frame that was read. Should be called
  * regularly to read new frames and store them in the internal buffer. */
 bool
 midi_reader_update (midi_reader_t *reader);
 
-/* Return next valid MIDI frame read by the reader, or NULL if none. */
+/* Return true if some source still has buffered bytes that were read but
+ * not parsed yet, so that "midi_reader_update" should be called again
+ * before waiting for new input. */
+bool
+midi_reader_pending (midi_reader_t *reader);
+
+/* Return next valid MIDI frame read by the reader, or NULL if none. The
+ * frame is copied and stays valid until next call. System exclusive frames
+ * longer than MIDI_FRAME_MAX are dropped and counted as missed.
+ */
 midi_frame_t*
 midi_reader_get_next (midi_reader_t *reader);
 
-/* Remove all recorded frames. */
+/* Return the next frame of the queue where it is stored, or NULL if the
+ * queue is empty. Unlike "midi_reader_get_next", no data is read from the
+ * sources: "midi_reader_update" should be called first. The frame stays in
+ * the queue until "midi_reader_commit" is called.
+ */
+const midi_qframe_t*
+midi_reader_peek (midi_reader_t *reader);
+
+/* Remove from the queue the frame returned by "midi_reader_peek". */
+void
+midi_reader_commit (midi_reader_t *reader);
+
+/* Read the sources once, then copy up to 'max' frames of the queue into
+ * 'frames' and remove them. Unlike "midi_reader_get_next", the queue is
+ * drained with a single update. System exclusive frames longer than
+ * MIDI_FRAME_MAX are dropped and counted as missed. Return the count of
+ * frames copied.
+ */
+int
+midi_reader_get_batch (midi_reader_t *reader, midi_frame_t *frames, int max);
+
+/* Store in 'frames' pointers to the first 'max' frames of the queue at
+ * most, in their order, without reading the sources nor removing them:
+ * they stay valid until they are removed by "midi_reader_commit_batch".
+ * Return the count of frames. Consumer side, like "midi_reader_peek".
+ */
+int
+midi_reader_peek_batch (midi_reader_t *reader, const midi_qframe_t **frames,
+			int max);
+
+/* Remove the first 'n' frames of the queue, as returned by
+ * "midi_reader_peek_batch".
+ */
+void
+midi_reader_commit_batch (midi_reader_t *reader, int n);
+
+/* Remove all recorded frames. Should be called by the consumer. */
 void
 midi_reader_clear_queue (midi_reader_t *reader);
 
+/* Get the count of bytes used in the queue, and the highest count since
+ * the reader was initialized. Either pointer may be NULL. May be called by
+ * any thread.
+ */
+void
+midi_reader_get_queue_usage (midi_reader_t *reader, uint32_t *used,
+				uint32_t *high);
+
 /* Get the statistics for the nth input source (0..; if -1: cumulated).
  * Returns false on failure.
  */
@@ -257,6 +591,71 @@ midi_reader_get_stats (midi_reader_t *reader,
 void
 midi_reader_reset_stats (midi_reader_t *reader, int n);
 
+/* Universal MIDI Packets (UMP), MIDI 1.0 protocol, group 0, as stored
+ * with MIDIR_UMP: each channel voice message is a type 2 word, each system
+ * common or real-time message a type 1 word, and a system exclusive
+ * message is cut into 64-bit type 3 packets (two words) of up to 6 data
+ * bytes. A running status frame gives a word per message. In the queue,
+ * the running status frames are cut every 32 messages, so that their
+ * words fit in a midi_frame_t, as well as the system exclusive frames of
+ * up to 96 data bytes; "midi_reader_peek" gets the longer ones.
+ */
+
+/* Convert a MIDI frame of 'len' bytes (from a status byte) to UMP words,
+ * when 'words' is not NULL and 'max' words are enough. Return the count of
+ * words of the frame.
+ */
+uint32_t
+midi_reader_ump_words (const unsigned char *data, uint32_t len,
+			uint32_t *words, uint32_t max);
+
+/* Convert 'n' UMP words back to MIDI bytes, without running status.
+ * Return the count of bytes, or -1 if 'max' bytes are not enough or a
+ * word is not a MIDI 1.0 message.
+ */
+int
+midi_reader_ump_bytes (const uint32_t *words, uint32_t n,
+			unsigned char *data, int max);
+
+/* Binary log format of the dump with MIDIR_DUMPLOG. A header of
+ * MIDI_LOG_HEADER bytes, the MIDI_LOG_MAGIC string followed by the time of
+ * the first frame (64 bits, little-endian), then one record per frame:
+ * the time since the previous frame (signed, zigzag-encoded), the source
+ * identifier and the length as LEB128 varints, and the bytes of the frame.
+ * Times are those of the reader clock. A log file may be mapped in memory
+ * and read with "midi_log_open" and "midi_log_next".
+ */
+#define MIDI_LOG_MAGIC		"MIDRLOG\001"
+#define MIDI_LOG_HEADER		16
+
+/* log being read, from memory */
+typedef struct midi_log_t {
+	const unsigned char *data; /* content of the log */
+	size_t len; /* its length */
+	size_t off; /* offset of the next record */
+	uint64_t time; /* time of the last record read */
+} midi_log_t;
+
+/* record of a log, pointing into the log data */
+typedef struct midi_log_frame_t {
+	uint64_t time; /* time of the frame */
+	uint16_t source; /* source identifier */
+	uint32_t len; /* length of the frame */
+	const unsigned char *data; /* bytes of the frame */
+} midi_log_frame_t;
+
+/* Start reading a log of 'len' bytes. Return false if there is no valid
+ * header.
+ */
+bool
+midi_log_open (midi_log_t *log, const void *data, size_t len);
+
+/* Read the next record of a log. Return 1 if a record was read, 0 at the
+ * end of the log, or -1 if the log is truncated or corrupted.
+ */
+int
+midi_log_next (midi_log_t *log, midi_log_frame_t *f);
+
 #ifdef __cplusplus
 } /* extern C */
 #endif